@@ -0,0 +1,107 @@
+// This file contains a bump-pointer allocator.
+//
+// An arena hands out memory from large blocks by advancing a pointer and
+// releases everything it allocated at once. The compiler never frees an
+// individual AST node, object or type, so it doesn't need malloc's
+// bookkeeping for them.
+//
+// Released blocks are kept on a free list and reused by the next arena
+// that needs one. Per-function arenas therefore recycle the same few
+// blocks, and so do repeated compiles in one process. The free list is
+// shared by all threads and guarded by a mutex.
+
+#include "chibicc.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    char data[];
+};
+
+// Free standard-size blocks
+static ArenaBlock *free_blocks;
+static pthread_mutex_t free_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ArenaBlock *new_block(size_t size) {
+    if (size <= ARENA_BLOCK_SIZE) {
+        pthread_mutex_lock(&free_blocks_lock);
+        ArenaBlock *block = free_blocks;
+        if (block)
+            free_blocks = block->next;
+        pthread_mutex_unlock(&free_blocks_lock);
+        if (block)
+            return block;
+    }
+
+    if (size < ARENA_BLOCK_SIZE)
+        size = ARENA_BLOCK_SIZE;
+
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (!block)
+        error("out of memory");
+    block->size = size;
+    return block;
+}
+
+// Returns `size` bytes of zeroed memory that live until the arena is
+// released.
+void *arena_alloc(Arena *arena, size_t size) {
+    // All objects allocated here hold pointers or ints, so 8-byte
+    // alignment is enough.
+    size = (size + 7) & ~(size_t)7;
+
+    if (size > (size_t)(arena->end - arena->cur)) {
+        ArenaBlock *block = new_block(size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->cur = block->data;
+        arena->end = block->data + block->size;
+    }
+
+    void *p = arena->cur;
+    arena->cur += size;
+    arena->nallocs++;
+    arena->nbytes += size;
+    memset(p, 0, size);
+    return p;
+}
+
+char *arena_strndup(Arena *arena, char *p, size_t len) {
+    char *s = arena_alloc(arena, len + 1);
+    memcpy(s, p, len);
+    return s;
+}
+
+// Releases all memory allocated from an arena. The arena can be used
+// again afterwards. Its counters are kept for reporting.
+void arena_release(Arena *arena) {
+    // Standard-size blocks are chained up first, so that they are put on
+    // the free list with one lock.
+    ArenaBlock *head = NULL, *tail = NULL;
+
+    ArenaBlock *block = arena->blocks;
+    while (block) {
+        ArenaBlock *next = block->next;
+        if (block->size == ARENA_BLOCK_SIZE) {
+            block->next = head;
+            head = block;
+            if (!tail)
+                tail = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+
+    if (head) {
+        pthread_mutex_lock(&free_blocks_lock);
+        tail->next = free_blocks;
+        free_blocks = head;
+        pthread_mutex_unlock(&free_blocks_lock);
+    }
+
+    arena->blocks = NULL;
+    arena->cur = arena->end = NULL;
+}
@@ -2,28 +2,51 @@
 #define CHIBICC_H
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef struct Type Type;
 typedef struct Node Node;
+typedef struct Inst Inst;
 
 //
-// Consts
+// arena.c
 //
+
+typedef struct ArenaBlock ArenaBlock;
+
 typedef struct {
-    bool requires_le_function;
-    bool requires_leq_function;
-    bool requires_ne_function;
-} Const;
+    ArenaBlock *blocks; // Blocks in use, newest first
+    char *cur;          // Free space in the newest block
+    char *end;
+    long nallocs;       // Number of allocations so far
+    long nbytes;        // Bytes handed out so far
+} Arena;
 
-Const init_const();
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, char *p, size_t len);
+void arena_release(Arena *arena);
 
 //
 // tokenize.c
@@ -38,23 +61,75 @@ typedef enum {
     TK_EOF,         // End of file
 } TokenKind;
 
-// Token type
+// Punctuators
+typedef enum {
+    PU_NONE,      // Not a punctuator
+    PU_PLUS,      // +
+    PU_MINUS,     // -
+    PU_STAR,      // *
+    PU_SLASH,     // /
+    PU_AMP,       // &
+    PU_EQ,        // ==
+    PU_NE,        // !=
+    PU_LT,        // <
+    PU_LE,        // <=
+    PU_GT,        // >
+    PU_GE,        // >=
+    PU_ASSIGN,    // =
+    PU_LPAREN,    // (
+    PU_RPAREN,    // )
+    PU_LBRACE,    // {
+    PU_RBRACE,    // }
+    PU_COMMA,     // ,
+    PU_SEMICOLON, // ;
+    PU_OTHER,     // Any other punctuation character
+} PunctKind;
+
+// Keywords
+typedef enum {
+    KW_NONE,   // Not a keyword
+    KW_RETURN, // return
+    KW_IF,     // if
+    KW_ELSE,   // else
+    KW_FOR,    // for
+    KW_WHILE,  // while
+    KW_INT,    // int
+} KeywordKind;
+
+// Token type. Tokens are stored contiguously, so the next token is
+// `tok + 1` and the last one is always TK_EOF.
 typedef struct Token Token;
 struct Token {
-    TokenKind kind; // Token kind
-    Token *next;    // Next token
-    int val;        // If kind is TK_NUM, its value
-    char *loc;      // Location of token
-    int len;        // Length of token
+    uint8_t kind;    // Token kind (TokenKind)
+    uint8_t punct;   // If kind is TK_PUNCT, its PunctKind
+    uint8_t keyword; // If kind is TK_KEYWORD, its KeywordKind
+    int len;         // Length of token
+    uint32_t pos;    // Offset of token in the input
+    union {
+        int val;     // If kind is TK_NUM, its value
+        int sym;     // If kind is TK_IDENT, its interned name
+    };
 };
 
+// An error trap catches errors raised on the thread that set it:
+// error() stores the diagnostic to `msg` and longjmps to `jmp`.
+typedef struct {
+    jmp_buf jmp;
+    char *msg;
+} ErrorTrap;
+
+extern _Thread_local ErrorTrap *error_trap;
+
+char *tok_loc(Token *tok);
+char *sym_name(int sym);
 void error(char *fmt, ...);
+void error_rethrow(char *msg);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
-Token *skip(Token *tok, char *op);
-bool consume(Token **rest, Token *tok, char *str);
-Token *tokenize(char *input);
+Token *skip(Token *tok, PunctKind kind);
+bool consume(Token **rest, Token *tok, PunctKind kind);
+Token *tokenize(char *p, size_t len);
 
 //
 // parse.c
@@ -64,18 +139,41 @@ Token *tokenize(char *input);
 typedef struct Obj Obj;
 struct Obj {
     Obj *next;
-    char *name; // Variable name
+    int sym;    // Variable name
     Type *ty;   // Type
+    long uses;  // Uses weighted by loop depth, for register allocation
+    int reg;    // Register holding the variable, or 0 if it is in memory
+    int offset; // Offset from the frame pointer, if the variable is in memory
+    int start;  // Live range, as numbers of the first and last use
+    int end;
 };
 
+// Number of rules in the peephole optimizer
+#define PEEPHOLE_RULES 8
+
 // Function
 typedef struct Function Function;
 struct Function {
     Function *next;
-    char *name;
+    int sym;
     Node *body;
+    Node *unfolded; // Body before constant folding, kept for statistics
     Obj *locals;
-    int stack_size;
+    int stack_size; // Bytes of the frame, which holds the locals in memory
+
+    Arena arena;    // Nodes, objects and code of this function
+    Inst *code;     // Generated instructions
+    int nregs;      // Locals are in registers R1 to R<nregs>
+
+    // Statistics
+    long nnodes;      // AST nodes created
+    long type_visits; // Nodes visited by type inference
+    long ninsts;      // Instructions generated
+    long folded_nodes; // AST nodes removed by constant folding
+    long folded_insts; // Instructions removed by constant folding
+    long peephole_hits[PEEPHOLE_RULES]; // Rewrites by each peephole rule
+    long reg_locals;  // Locals kept in registers
+    long mem_locals;  // Locals kept in memory
 };
 
 // AST node
@@ -102,35 +200,66 @@ typedef enum {
     ND_NUM,       // Integer
 } NodeKind;
 
-// AST node type
+// AST node type. Nodes share a small header, and the rest of a node
+// depends on its kind. Only the union member used by the kind is
+// allocated, so a node must never be accessed through the members of
+// other kinds.
 struct Node {
     NodeKind kind; // Node kind
     Node *next;    // Next node
     Type *ty;
     Token *tok;    // Representative token
 
-    Node *lhs;     // Left-hand side
-    Node *rhs;     // Right-hand side
+    union {
+        // Operators, "return" and expression statements
+        struct {
+            Node *lhs; // Left-hand side
+            Node *rhs; // Right-hand side, for binary operators
+        };
+
+        // "if" or "for" statement
+        struct {
+            Node *cond;
+            Node *then;
+            union {
+                Node *els;  // "if"
+                Node *init; // "for"
+            };
+            Node *inc;
+        };
+
+        // Block
+        Node *body;
+
+        // Function call
+        struct {
+            int funcsym;
+            Node *args;
+        };
+
+        Obj *var;      // If kind is ND_VAR, its object
+        int val;       // If kind is ND_NUM, its value
+    };
+};
 
-    // "if" or "for" statement
-    Node *cond;
-    Node *then;
-    Node *els;
-    Node *init;
-    Node *inc;
+Node *copy_tree(Node *node);
+Function *parse(Token *tok);
 
-    // Block
-    Node *body;
+//
+// fold.c
+//
 
-    // Function call
-    char *funcname;
-    Node *args;
+void fold_function(Function *fn);
 
-    Obj *var;      // If kind is ND_VAR, its object
-    int val;       // If kind is ND_NUM, its value
-};
+//
+// regalloc.c
+//
 
-Function *parse(Token *tok, Const *cons);
+// The frame pointer register. It holds the address of the frame of the
+// running function.
+#define REG_FP 6
+
+void alloc_locals(Function *fn, Node *body);
 
 //
 // type.c
@@ -142,15 +271,15 @@ typedef enum {
     TY_FUNC,
 } TypeKind;
 
+// Types are hash-consed: pointer_to() and func_type() return the same
+// object for the same base type, so two types are equal if and only if
+// they are the same pointer. Types must not be modified once created.
 struct Type {
     TypeKind kind;
 
     // Pointer
     Type *base;
 
-    // Declaration
-    Token *name;
-
     // Function type
     Type *return_ty;
 };
@@ -162,11 +291,182 @@ Type *pointer_to(Type *base);
 Type *func_type(Type *return_ty);
 void add_type(Node *node);
 
+//
+// output.c
+//
+
+// A growable in-memory output buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+char *buf_reserve(Buffer *b, size_t len);
+void buf_free(Buffer *b);
+
+// Writes buffers to an output stream, optionally on its own thread
+typedef struct {
+    FILE *out;
+    int fd;             // -1 if `out` has no file descriptor
+    bool closed;
+    int err;            // errno of the first failed write
+
+    // Threaded writers only
+    bool threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Buffer pending[8];  // Buffers to write, oldest first
+    int npending;
+    Buffer spare;       // Written-out memory for reuse
+    bool closing;
+
+    // Statistics
+    long nbytes;
+    long nwrites;       // write(2) or fwrite() calls
+} Writer;
+
+Writer *new_writer(FILE *out, bool threaded);
+void writer_put(Writer *w, Buffer *b);
+int writer_close(Writer *w);
+
+//
+// ir.c
+//
+
+// Yamini instructions
+typedef enum {
+    OP_LABEL,     // %label
+    OP_LOAD,      // LOAD n
+    OP_LOAD_VAR,  // LOAD &var
+    OP_LOAD_ADDR, // LOAD $var
+    OP_LOAD_REG,  // LOAD Rn
+    OP_POP_VAR,   // POP &var
+    OP_POP_PTR,   // POP *var
+    OP_POP_REG,   // POP Rn
+    OP_ADD,       // ADD
+    OP_SUB,       // SUB
+    OP_MUL,       // MUL
+    OP_DIV,       // DIV
+    OP_NEG,       // NEG
+    OP_EQU,       // EQU
+    OP_DEREF,     // DEREF
+    OP_JMP,       // JMP %label
+    OP_JZ,        // JZ %label
+    OP_JN,        // JN %label
+    OP_CALL,      // CALL %label
+    OP_RET,       // RET
+    OP_SHOW,      // SHOW
+    OP_HALT,      // HALT
+} Opcode;
+
+// A label is written as its parts joined by ".", leaving out the ones
+// that are absent: "%l.else.main.1", "%l.return.main", "%main", "%start".
+// Each label is one object, which its definition and all jumps to it
+// refer to. Calls to a function create labels of their own.
+typedef struct {
+    char *prefix;   // NULL for the entry point of a function
+    int sym;        // Function the label belongs to, or -1
+    int n;          // Number within the function, or 0
+
+    // Kept up to date by codegen and the peephole optimizer
+    Inst *def;      // The OP_LABEL instruction
+    int refs;       // Number of jumps to the label
+} Label;
+
+// Instruction. Instructions of a function form a list in program order.
+struct Inst {
+    Inst *next;
+    Opcode op;
+    union {
+        int val;        // OP_LOAD
+        int reg;        // OP_LOAD_REG and OP_POP_REG
+        char *name;     // Variable operand
+        Label *label;   // OP_LABEL, jumps and OP_CALL
+    };
+};
+
+void print_code(Buffer *b, Inst *code);
+
+//
+// peephole.c
+//
+
+void peephole(Function *fn);
+void print_peephole_stats(FILE *out, Function *prog);
+
+//
+// compile.c
+//
+
+typedef struct {
+    uint32_t hash;
+    int sym;        // -1 if the slot is empty
+} SymEntry;
+
+// A compiler context holds everything that lives for one compilation.
+// A context can be reused, and contexts used by different threads are
+// independent of each other.
+typedef struct {
+    char *filename;     // Name of the input in diagnostics
+    FILE *stats;        // If non-NULL, statistics are written here
+    FILE *fold_stats;   // If non-NULL, folding statistics of each function go here
+    int nthreads;       // Number of threads to use
+    char *errmsg;       // Diagnostic of the last failed compile()
+
+    // Input and output of the current compilation
+    char *input;
+    size_t input_len;
+    FILE *out;
+
+    // Token buffer
+    Token *tokens;
+    size_t tokens_len;
+    size_t tokens_cap;
+
+    // Interned identifiers. sym_table is an open-addressing hash table
+    // of symbol ids, which index sym_names and sym_lens.
+    SymEntry *sym_table;
+    int sym_table_cap;
+    char **sym_names;
+    int *sym_lens;
+    int nsyms;
+
+    // Derived types, keyed by their kind and the type they are derived from
+    Type **type_table;
+    int type_table_cap;
+    int type_table_used;
+
+    // Types, functions and interned names live until the end of the
+    // compilation. Each function's AST nodes and variables live in its
+    // own arena.
+    Arena arena;
+    Function *prog;
+
+    pthread_mutex_t type_lock;  // Guards type_table and types in `arena`
+
+    Writer *writer;     // Output of code generation
+} Compiler;
+
+// The context of the compilation running on this thread
+extern _Thread_local Compiler *current_ctx;
+
+Compiler *new_compiler(void);
+void free_compiler(Compiler *ctx);
+int compile(Compiler *ctx, char *src, size_t len, FILE *out);
+
+//
+// pool.c
+//
+
+char *parallel_for(int nthreads, int njobs, void (*fn)(void *arg, int i), void *arg);
+
 //
 // codegen.c
 //
 
-void codegen(Function *prog, Const *cons);
+void codegen(Function *prog);
 
 //
 // helpers.c
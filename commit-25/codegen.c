@@ -1,19 +1,115 @@
 #include "chibicc.h"
 
-static char *argreg[] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6"};
-static Function *current_fn;
+// Output is handed to the writer in chunks of about this size.
+#define WRITE_CHUNK (1 << 20)
+
+// Functions generated in parallel per batch. Batches bound the memory
+// held by finished buffers, and let the writer write one batch while
+// the next is generated.
+#define GEN_BATCH 1024
+
+// The function being generated and its buffer. Functions are generated
+// independently, so this state is per thread.
+static _Thread_local Function *current_fn;
+static _Thread_local Buffer *output;
+
+// Instructions are appended to *code_tail and allocated from code_arena.
+static _Thread_local Inst **code_tail;
+static _Thread_local Arena *code_arena;
+static _Thread_local Label *return_label;
+
+// Label numbers start over in each function. Labels include the
+// function name, which keeps them unique in the program.
+static _Thread_local int label_count;
 
 static void gen_expr(Node *node);
 
 static int count(void) {
-    static int i = 1;
-    return i++;
+    return ++label_count;
+}
+
+static Label *new_label(char *prefix, int sym, int n) {
+    Label *label = arena_alloc(code_arena, sizeof(Label));
+    label->prefix = prefix;
+    label->sym = sym;
+    label->n = n;
+    return label;
+}
+
+static Inst *emit(Opcode op) {
+    Inst *inst = arena_alloc(code_arena, sizeof(Inst));
+    inst->op = op;
+    *code_tail = inst;
+    code_tail = &inst->next;
+    return inst;
+}
+
+static void emit_val(Opcode op, int val) {
+    emit(op)->val = val;
+}
+
+static void emit_name(Opcode op, char *name) {
+    emit(op)->name = name;
+}
+
+static void emit_label(Opcode op, Label *label) {
+    Inst *inst = emit(op);
+    inst->label = label;
+
+    if (op == OP_LABEL)
+        label->def = inst;
+    else if (op != OP_CALL)
+        label->refs++;
+}
+
+// Emits code that compares the two values on top of the stack and
+// leaves 1 or 0 in their place. `cmp` combines the two values, and
+// `jumps` are the conditional jumps taken if the comparison is true.
+// Jumps don't pop, so both paths pop the combined value into R0.
+static void gen_compare(Opcode cmp, Opcode *jumps, int njumps) {
+    int c = count();
+    Label *true_label = new_label("l.true", current_fn->sym, c);
+    Label *end = new_label("l.end", current_fn->sym, c);
+
+    emit(cmp);
+    for (int i = 0; i < njumps; i++)
+        emit_label(jumps[i], true_label);
+    emit_val(OP_POP_REG, 0);
+    emit_val(OP_LOAD, 0);
+    emit_label(OP_JMP, end);
+    emit_label(OP_LABEL, true_label);
+    emit_val(OP_POP_REG, 0);
+    emit_val(OP_LOAD, 1);
+    emit_label(OP_LABEL, end);
+}
+
+// Pushes the address of a local in memory, which is at a fixed offset
+// from the frame pointer.
+static void gen_frame_addr(Obj *var) {
+    emit_val(OP_LOAD_REG, REG_FP);
+    if (var->offset) {
+        emit_val(OP_LOAD, var->offset);
+        emit(OP_ADD);
+    }
+}
+
+// Pops an address and then a value, and stores the value there. POP *
+// stores through a pointer in a named variable, so the address goes to
+// the scratch variable first.
+static void gen_store(void) {
+    emit_name(OP_POP_VAR, "lval");
+    emit_name(OP_POP_PTR, "lval");
 }
 
 static void gen_var(Node *node) {
     switch (node->kind) {
         case ND_VAR:
-            printf("LOAD &%s\n", node->var->name);
+            if (node->var->reg) {
+                emit_val(OP_LOAD_REG, node->var->reg);
+            } else {
+                gen_frame_addr(node->var);
+                emit(OP_DEREF);
+            }
             return;
         case ND_DEREF:
             gen_expr(node->lhs);
@@ -25,57 +121,81 @@ static void gen_var(Node *node) {
     error_tok(node->tok, "Not an lvalue!");
 }
 
+// Moves the frame pointer up or down by `size` bytes
+static void gen_move_frame(Opcode op, int size) {
+    emit_val(OP_LOAD_REG, REG_FP);
+    emit_val(OP_LOAD, size);
+    emit(op);
+    emit_val(OP_POP_REG, REG_FP);
+}
+
 static void gen_expr(Node *node) {
     switch (node->kind) {
         case ND_NUM:
-            printf("LOAD %d\n", node->val);
+            emit_val(OP_LOAD, node->val);
             return;
         case ND_NEG:
             gen_expr(node->lhs);
-            printf("NEG\n");
+            emit(OP_NEG);
             return;
         case ND_VAR:
             gen_var(node);
             return;
         case ND_DEREF:
             gen_expr(node->lhs);
-            printf("DEREF\n");
+            emit(OP_DEREF);
             return;
         case ND_ADDR:
-            printf("LOAD $%s\n", node->lhs->var->name);
+            // &*p is p
+            if (node->lhs->kind == ND_DEREF)
+                gen_expr(node->lhs->lhs);
+            else
+                gen_frame_addr(node->lhs->var);
             return;
         case ND_ASSIGN:
             gen_expr(node->rhs);
             switch (node->lhs->kind) {
                 case ND_VAR:
-                    printf("POP &%s\n", node->lhs->var->name);
+                    if (node->lhs->var->reg) {
+                        emit_val(OP_POP_REG, node->lhs->var->reg);
+                    } else {
+                        gen_frame_addr(node->lhs->var);
+                        gen_store();
+                    }
                     return;
                 case ND_DEREF:
-                    switch (node->lhs->lhs->kind) {
-                        case ND_VAR:
-                            printf("POP *%s\n", node->lhs->lhs->var->name);
-                            return;
-                        case ND_ADD:
-                        case ND_SUB:
-                            gen_expr(node->lhs->lhs);
-                            printf("POP &lval\n");
-                            printf("POP *lval\n");
-                            return;
-                        default:
-                            error("Unexpected node kind %d", node->lhs->lhs->kind);
-                    }
+                    gen_expr(node->lhs->lhs);
+                    gen_store();
+                    return;
                 default:
                     error("Invalid node kind %d", node->lhs->kind);
             }
             return;
         case ND_FUNCALL: {
-            int nargs = 0;
-            for (Node *arg = node->args; arg; arg = arg->next) {
+            // The callee may use the same registers, so they are saved
+            // below the arguments. After the call, the return value is
+            // set aside in R0 while they are restored.
+            int nregs = current_fn->nregs;
+            for (int i = 1; i <= nregs; i++)
+                emit_val(OP_LOAD_REG, i);
+
+            for (Node *arg = node->args; arg; arg = arg->next)
                 gen_expr(arg);
-                nargs++;
-            }
 
-            printf("CALL %%%s\n", node->funcname);
+            // The callee's frame goes right above the caller's.
+            int size = current_fn->stack_size;
+            if (size)
+                gen_move_frame(OP_ADD, size);
+            emit_label(OP_CALL, new_label(NULL, node->funcsym, 0));
+            if (size)
+                gen_move_frame(OP_SUB, size);
+
+            if (nregs) {
+                emit_val(OP_POP_REG, 0);
+                for (int i = nregs; i >= 1; i--)
+                    emit_val(OP_POP_REG, i);
+                emit_val(OP_LOAD_REG, 0);
+            }
             return;
         }
         default:
@@ -87,28 +207,32 @@ static void gen_expr(Node *node) {
 
     switch (node->kind) {
         case ND_ADD:
-            printf("ADD\n");
+            emit(OP_ADD);
             return;
         case ND_SUB:
-            printf("SUB\n");
+            emit(OP_SUB);
             return;
         case ND_MUL:
-            printf("MUL\n");
+            emit(OP_MUL);
             return;
         case ND_DIV:
-            printf("DIV\n");
+            emit(OP_DIV);
             return;
         case ND_EQ:
-            printf("EQU\n");
+            emit(OP_EQU);
             return;
         case ND_NE:
-            printf("CALL %%ne\n");
+            // a != b is 1 - (a == b), which needs no jumps.
+            emit(OP_EQU);
+            emit(OP_NEG);
+            emit_val(OP_LOAD, 1);
+            emit(OP_ADD);
             return;
         case ND_LT:
-            printf("CALL %%le\n");
+            gen_compare(OP_SUB, (Opcode[]){OP_JN}, 1);
             return;
         case ND_LE:
-            printf("CALL %%leq\n");
+            gen_compare(OP_SUB, (Opcode[]){OP_JN, OP_JZ}, 2);
             return;
         default:
             error("Unexpected node kind %d", node->kind);
@@ -118,81 +242,123 @@ static void gen_expr(Node *node) {
     error_tok(node->tok, "Invalid expression!");
 }
 
-void compile_relational_functions(Const *cons) {
-    if (cons->requires_le_function) {
-        printf("%%le\n");
-        printf("SUB\n");
-        printf("JN %%less\n");
-        printf("POP R0\n");
-        printf("LOAD 0\n");
-        printf("JMP %%end\n");
-        printf("%%less\n");
-        printf("POP R0\n");
-        printf("LOAD 1\n");
-        printf("%%end\n");
-        printf("RET\n");
-    }
+static bool is_zero(Node *node) {
+    return node->kind == ND_NUM && node->val == 0;
+}
 
-    if (cons->requires_leq_function) {
-        printf("%%leq\n");
-        printf("SUB\n");
-        printf("JN %%lesseq\n");
-        printf("JZ %%lesseq\n");
-        printf("POP R0\n");
-        printf("LOAD 0\n");
-        printf("JMP %%end\n");
-        printf("%%lesseq\n");
-        printf("POP R0\n");
-        printf("LOAD 1\n");
-        printf("%%end\n");
-        printf("RET\n");
+// Returns true if the test of a condition jumps when the condition
+// holds, or false if it jumps when the condition fails. Yamini jumps
+// only on zero or negative values, so <, <= and == jump when they hold
+// and all other conditions jump when they fail.
+static bool branches_if_true(Node *cond) {
+    switch (cond->kind) {
+        case ND_LT:
+        case ND_LE:
+        case ND_EQ:
+            return true;
+        default:
+            return false;
     }
+}
+
+// Emits the test of a condition, which jumps to `label` on the outcome
+// given by branches_if_true() and falls through otherwise. Comparisons
+// jump on the difference of their operands instead of producing 0 or
+// 1 first. A comparison with zero needs no subtraction.
+//
+// Jumps don't pop, so the tested value is still on the stack on both
+// paths. The code at `label` and the code after the test must pop it.
+static void gen_branch(Node *cond, Label *label) {
+    switch (cond->kind) {
+        case ND_LT:
+        case ND_LE:
+        case ND_EQ:
+        case ND_NE:
+            if (is_zero(cond->rhs)) {
+                gen_expr(cond->lhs);
+            } else if (is_zero(cond->lhs) && (cond->kind == ND_EQ || cond->kind == ND_NE)) {
+                gen_expr(cond->rhs);
+            } else {
+                gen_expr(cond->lhs);
+                gen_expr(cond->rhs);
+                emit(OP_SUB);
+            }
 
-    if (cons->requires_ne_function) {
-        printf("%%ne\n");
-        printf("EQU\n");
-        printf("JZ %%neq\n");
-        printf("POP R0\n");
-        printf("LOAD 0\n");
-        printf("JMP %%end\n");
-        printf("%%neq\n");
-        printf("POP R0\n");
-        printf("LOAD 1\n");
-        printf("%%end\n");
-        printf("RET\n");
+            if (cond->kind == ND_LT || cond->kind == ND_LE)
+                emit_label(OP_JN, label);
+            if (cond->kind != ND_LT)
+                emit_label(OP_JZ, label);
+            return;
+        default:
+            gen_expr(cond);
+            emit_label(OP_JZ, label);
+            return;
     }
 }
 
 static void gen_stmt(Node *node) {
     switch (node->kind) {
         case ND_IF: {
+            // The branch taken by the jump goes last.
             int c = count();
-            gen_expr(node->cond);
-            printf("JZ %%l.else.%d\n", c);
-            gen_stmt(node->then);
-            printf("JMP %%l.end.%d\n", c);
-            printf("%%l.else.%d\n", c);
-            if (node->els)
-                gen_stmt(node->els);
-            printf("%%l.end.%d\n", c);
+            bool on_true = branches_if_true(node->cond);
+            Label *target = new_label(on_true ? "l.then" : "l.else", current_fn->sym, c);
+            Label *end = new_label("l.end", current_fn->sym, c);
+            Node *fall = on_true ? node->els : node->then;
+            Node *jump = on_true ? node->then : node->els;
+
+            gen_branch(node->cond, target);
+            emit_val(OP_POP_REG, 0);
+            if (fall)
+                gen_stmt(fall);
+            emit_label(OP_JMP, end);
+            emit_label(OP_LABEL, target);
+            emit_val(OP_POP_REG, 0);
+            if (jump)
+                gen_stmt(jump);
+            emit_label(OP_LABEL, end);
             return;
         }
         case ND_FOR: {
             int c = count();
+            Label *begin = new_label(".l.begin", current_fn->sym, c);
+            Label *end = new_label("l.end", current_fn->sym, c);
             if (node->init) {
                 gen_stmt(node->init);
             }
-            printf("%%.l.begin.%d\n", c);
+
+            // A condition that jumps when it holds is tested after the
+            // body, so that it jumps straight back into the loop.
+            if (node->cond && branches_if_true(node->cond)) {
+                Label *cond = new_label("l.cond", current_fn->sym, c);
+                emit_label(OP_JMP, cond);
+                emit_label(OP_LABEL, begin);
+                emit_val(OP_POP_REG, 0);
+                gen_stmt(node->then);
+                if (node->inc) {
+                    gen_expr(node->inc);
+                }
+                emit_label(OP_LABEL, cond);
+                gen_branch(node->cond, begin);
+                emit_val(OP_POP_REG, 0);
+                return;
+            }
+
+            emit_label(OP_LABEL, begin);
             if (node->cond) {
-                gen_expr(node->cond);
-                printf("JZ %%l.end.%d\n", c);
+                gen_branch(node->cond, end);
+                emit_val(OP_POP_REG, 0);
             }
             gen_stmt(node->then);
             if (node->inc) {
                 gen_expr(node->inc);
             }
-            printf("JMP %%.l.begin.%d\n", c);
-            printf("%%l.end.%d\n", c);
+            emit_label(OP_JMP, begin);
+            emit_label(OP_LABEL, end);
+            if (node->cond) {
+                emit_val(OP_POP_REG, 0);
+            }
+            return;
         }
         case ND_BLOCK:
             for (Node *n = node->body; n; n = n->next) 
@@ -201,10 +367,14 @@ static void gen_stmt(Node *node) {
             return;
         case ND_RETURN: 
             gen_expr(node->lhs);
-            printf("JMP %%l.return.%s\n", current_fn->name);
+            emit_label(OP_JMP, return_label);
             return;
         case ND_EXPR_STMT:
+            // An assignment leaves nothing on the stack, other
+            // expressions leave a value that is discarded.
             gen_expr(node->lhs);
+            if (node->lhs->kind != ND_ASSIGN)
+                emit_val(OP_POP_REG, 0);
             return;
         default:
             error("Unexpected node kind %d", node->kind);
@@ -213,23 +383,137 @@ static void gen_stmt(Node *node) {
     error_tok(node->tok, "Invalid statement!");
 }
 
-void codegen(Function *prog, Const *cons) {
-    printf("JMP %%start\n");
+// Starts a list of instructions allocated from `arena`
+static void start_code(Inst **code, Arena *arena) {
+    *code = NULL;
+    code_tail = code;
+    code_arena = arena;
+}
+
+// Generates `body` as the code of the current function into *code
+static void gen_body(Node *body, Inst **code) {
+    label_count = 0;
+    start_code(code, &current_fn->arena);
+    return_label = new_label("l.return", current_fn->sym, 0);
+    alloc_locals(current_fn, body);
+
+    emit_label(OP_LABEL, new_label(NULL, current_fn->sym, 0));
+    gen_stmt(body);
+    emit_label(OP_LABEL, return_label);
+    emit(OP_RET);
+}
+
+static long count_insts(Inst *code) {
+    long n = 0;
+    for (Inst *inst = code; inst; inst = inst->next)
+        n++;
+    return n;
+}
+
+static void gen_function(Function *fn) {
+    current_fn = fn;
+
+    // The instructions removed by constant folding are counted by
+    // generating the body as it was before folding as well. The code
+    // before peephole optimization is compared.
+    if (fn->unfolded) {
+        Inst *code;
+        gen_body(fn->unfolded, &code);
+        fn->folded_insts = count_insts(code);
+    }
+
+    gen_body(fn->body, &fn->code);
+    if (fn->unfolded)
+        fn->folded_insts -= count_insts(fn->code);
+
+    peephole(fn);
+    fn->ninsts = count_insts(fn->code);
+
+    print_code(output, fn->code);
+
+    // The function's AST and code are no longer needed.
+    arena_release(&fn->arena);
+}
+
+typedef struct {
+    Function **fns;
+    Buffer *bufs;   // Output of each function
+} GenJobs;
+
+static void gen_job(void *arg, int i) {
+    GenJobs *jobs = arg;
+    output = &jobs->bufs[i];
+    gen_function(jobs->fns[i]);
+}
+
+// Generates functions on `nthreads` threads into separate buffers, and
+// writes the buffers out in source order. The output is the same as
+// generating the functions one after another.
+static void gen_parallel(Function *prog, int nthreads) {
+    GenJobs jobs = {
+        .fns = malloc(sizeof(Function *) * GEN_BATCH),
+        .bufs = calloc(GEN_BATCH, sizeof(Buffer)),
+    };
+
+    char *errmsg = NULL;
+
+    for (Function *fn = prog; fn && !errmsg;) {
+        int n = 0;
+        for (; fn && n < GEN_BATCH; fn = fn->next)
+            jobs.fns[n++] = fn;
+
+        errmsg = parallel_for(nthreads, n, gen_job, &jobs);
+
+        // writer_put() leaves the buffers empty for the next batch.
+        for (int i = 0; i < n && !errmsg; i++)
+            writer_put(current_ctx->writer, &jobs.bufs[i]);
+    }
+
+    for (int i = 0; i < GEN_BATCH; i++)
+        buf_free(&jobs.bufs[i]);
+    free(jobs.fns);
+    free(jobs.bufs);
+
+    if (errmsg)
+        error_rethrow(errmsg);
+}
+
+void codegen(Function *prog) {
+    Buffer buf = {};
+    Inst *code;
 
-    compile_relational_functions(cons);
-    
-    for (Function *fn = prog; fn; fn = fn->next) {
-        printf("%%%s\n", fn->name);
-        current_fn = fn;
+    // The code around functions lives until the end of the compilation.
+    start_code(&code, &current_ctx->arena);
+    emit_label(OP_JMP, new_label("start", -1, 0));
+    print_code(&buf, code);
 
-        gen_stmt(fn->body);
+    output = &buf;
 
-        printf("%%l.return.%s\n", fn->name);
-        printf("RET\n");
+    if (current_ctx->nthreads > 1) {
+        writer_put(current_ctx->writer, &buf);
+        gen_parallel(prog, current_ctx->nthreads);
+        output = &buf;  // A job may have run on this thread
+    } else {
+        for (Function *fn = prog; fn; fn = fn->next) {
+            gen_function(fn);
+            if (buf.len >= WRITE_CHUNK)
+                writer_put(current_ctx->writer, &buf);
+        }
     }
 
-    printf("%%start\n");
-    printf("CALL %%main\n");
-    printf("SHOW\n");
-    printf("HALT\n");
-}
\ No newline at end of file
+    start_code(&code, &current_ctx->arena);
+    emit_label(OP_LABEL, new_label("start", -1, 0));
+
+    // Frames start at the address of the variable "stack" and grow
+    // upwards. It is the last variable in the program, so nothing else
+    // is above it.
+    emit_name(OP_LOAD_ADDR, "stack");
+    emit_val(OP_POP_REG, REG_FP);
+    emit_label(OP_CALL, new_label("main", -1, 0));
+    emit(OP_SHOW);
+    emit(OP_HALT);
+    print_code(&buf, code);
+
+    writer_put(current_ctx->writer, &buf);
+    buf_free(&buf);
+}
@@ -0,0 +1,202 @@
+// This file contains the entry point of the compiler library.
+//
+// compile() translates one source buffer and writes the program to a
+// stream. All state of a compilation hangs off a Compiler context, so a
+// process can run any number of compilations, one after another on the
+// same context or concurrently on different threads. Errors make
+// compile() return instead of terminating the process.
+
+#include "chibicc.h"
+
+_Thread_local Compiler *current_ctx;
+
+Compiler *new_compiler(void) {
+    Compiler *ctx = calloc(1, sizeof(Compiler));
+    ctx->filename = "<input>";
+    ctx->nthreads = 1;
+    pthread_mutex_init(&ctx->type_lock, NULL);
+    return ctx;
+}
+
+// Releases all memory owned by a context
+void free_compiler(Compiler *ctx) {
+    arena_release(&ctx->arena);
+    free(ctx->tokens);
+    free(ctx->sym_table);
+    free(ctx->sym_names);
+    free(ctx->sym_lens);
+    free(ctx->type_table);
+    free(ctx->errmsg);
+    pthread_mutex_destroy(&ctx->type_lock);
+    free(ctx);
+}
+
+// Empties the tables of the previous compilation. Their memory is kept.
+static void reset(Compiler *ctx) {
+    for (int i = 0; i < ctx->sym_table_cap; i++)
+        ctx->sym_table[i].sym = -1;
+    ctx->nsyms = 0;
+
+    if (ctx->type_table)
+        memset(ctx->type_table, 0, sizeof(Type *) * ctx->type_table_cap);
+    ctx->type_table_used = 0;
+
+    ctx->arena = (Arena){};
+    ctx->prog = NULL;
+}
+
+// Returns the current time in seconds
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_arena_stats(Compiler *ctx) {
+    fprintf(ctx->stats, "arena compile: %ld allocs, %ld bytes\n",
+            ctx->arena.nallocs, ctx->arena.nbytes);
+
+    long narenas = 0, nallocs = 0, nbytes = 0, max = 0;
+    for (Function *fn = ctx->prog; fn; fn = fn->next) {
+        narenas++;
+        nallocs += fn->arena.nallocs;
+        nbytes += fn->arena.nbytes;
+        if (max < fn->arena.nbytes)
+            max = fn->arena.nbytes;
+    }
+
+    fprintf(ctx->stats, "arena function: %ld arenas, %ld allocs, %ld bytes, largest %ld bytes\n",
+            narenas, nallocs, nbytes, max);
+}
+
+static void print_code_stats(Compiler *ctx) {
+    long ninsts = 0;
+    for (Function *fn = ctx->prog; fn; fn = fn->next)
+        ninsts += fn->ninsts;
+
+    fprintf(ctx->stats, "code: %ld instructions\n", ninsts);
+}
+
+static void print_fold_stats(Compiler *ctx) {
+    long nnodes = 0, ninsts = 0;
+    for (Function *fn = ctx->prog; fn; fn = fn->next) {
+        nnodes += fn->folded_nodes;
+        ninsts += fn->folded_insts;
+    }
+
+    fprintf(ctx->stats, "fold: %ld nodes, %ld instructions eliminated\n", nnodes, ninsts);
+}
+
+// Prints what constant folding removed from each function, in source order
+static void print_function_fold_stats(Compiler *ctx) {
+    for (Function *fn = ctx->prog; fn; fn = fn->next)
+        fprintf(ctx->fold_stats, "fold: %s: %ld nodes, %ld instructions eliminated\n",
+                sym_name(fn->sym), fn->folded_nodes, fn->folded_insts);
+}
+
+static void print_regalloc_stats(Compiler *ctx) {
+    long nregs = 0, nmem = 0, nslots = 0;
+    for (Function *fn = ctx->prog; fn; fn = fn->next) {
+        nregs += fn->reg_locals;
+        nmem += fn->mem_locals;
+        nslots += fn->stack_size / 8;
+    }
+
+    fprintf(ctx->stats, "regalloc: %ld locals in registers, %ld in memory in %ld slots\n",
+            nregs, nmem, nslots);
+}
+
+static void print_type_stats(Compiler *ctx) {
+    long nnodes = 0, nvisits = 0;
+    for (Function *fn = ctx->prog; fn; fn = fn->next) {
+        nnodes += fn->nnodes;
+        nvisits += fn->type_visits;
+    }
+
+    fprintf(ctx->stats, "typing: %ld visits for %ld nodes\n", nvisits, nnodes);
+}
+
+static void run(Compiler *ctx) {
+    double start = now();
+    Token *tok = tokenize(ctx->input, ctx->input_len);
+
+    if (ctx->stats) {
+        double elapsed = now() - start;
+        size_t ntokens = ctx->tokens_len - 1;
+        fprintf(ctx->stats, "tokenize: %zu tokens in %.3f ms (%.1f Mtokens/s)\n",
+                ntokens, elapsed * 1e3, ntokens / elapsed / 1e6);
+    }
+
+    start = now();
+    parse(tok);
+
+    if (ctx->stats)
+        fprintf(ctx->stats, "parse: %.3f ms\n", (now() - start) * 1e3);
+
+    // Traverse the AST to emit assembly. The writer gets its own thread
+    // when there are threads to spare.
+    start = now();
+    ctx->writer = new_writer(ctx->out, ctx->nthreads > 1);
+    codegen(ctx->prog);
+
+    int err = writer_close(ctx->writer);
+    if (err)
+        error("write error: %s", strerror(err));
+
+    if (ctx->stats) {
+        fprintf(ctx->stats, "codegen: %.3f ms\n", (now() - start) * 1e3);
+        fprintf(ctx->stats, "output: %ld bytes in %ld writes\n",
+                ctx->writer->nbytes, ctx->writer->nwrites);
+        print_code_stats(ctx);
+        print_fold_stats(ctx);
+        print_peephole_stats(ctx->stats, ctx->prog);
+        print_regalloc_stats(ctx);
+        print_type_stats(ctx);
+        print_arena_stats(ctx);
+    }
+
+    if (ctx->fold_stats)
+        print_function_fold_stats(ctx);
+}
+
+// Compiles the `len` bytes at src and writes the program to `out`.
+// Returns 0 on success. On error, returns nonzero and leaves the
+// diagnostic in ctx->errmsg; `out` may have received partial output.
+int compile(Compiler *ctx, char *src, size_t len, FILE *out) {
+    reset(ctx);
+    ctx->input = src;
+    ctx->input_len = len;
+    ctx->out = out;
+
+    Compiler *saved = current_ctx;
+    current_ctx = ctx;
+
+    ErrorTrap *saved_trap = error_trap;
+    ErrorTrap trap = {};
+    error_trap = &trap;
+
+    int status = 0;
+    if (setjmp(trap.jmp) == 0) {
+        run(ctx);
+    } else {
+        free(ctx->errmsg);
+        ctx->errmsg = trap.msg;
+        status = 1;
+    }
+
+    // Functions left behind by an error still own their arenas.
+    for (Function *fn = ctx->prog; fn; fn = fn->next)
+        arena_release(&fn->arena);
+    arena_release(&ctx->arena);
+    ctx->prog = NULL;
+
+    if (ctx->writer) {
+        writer_close(ctx->writer);
+        free(ctx->writer);
+        ctx->writer = NULL;
+    }
+
+    error_trap = saved_trap;
+    current_ctx = saved;
+    return status;
+}
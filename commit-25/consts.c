@@ -1,10 +0,0 @@
-#include "chibicc.h"
-
-Const init_const() {
-    Const cons;
-    cons.requires_le_function = false;
-    cons.requires_leq_function = false;
-    cons.requires_ne_function = false;
-
-    return cons;
-}
\ No newline at end of file
@@ -0,0 +1,307 @@
+// This file contains constant folding and algebraic simplification.
+//
+// fold_function() rewrites the AST of a function after it is parsed.
+// Operators whose operands are constants are evaluated, and operators
+// that have no effect, such as x+0, x*1 or - -x, are removed. Constant
+// addends are combined, so that (x+1)+2 becomes x+3. Since pointer
+// offsets are scaled by a constant, constant offsets fold as well.
+//
+// The pass only removes nodes. A folded operator is replaced by one of
+// its operands, so it needs no allocation. Every node it removes is
+// counted in the function's statistics. When statistics are printed,
+// the body is copied before folding, and codegen counts the
+// instructions removed by generating both.
+
+#include "chibicc.h"
+
+// The function being folded. Functions are folded by the thread that
+// parsed them.
+static _Thread_local Function *current_fn;
+
+static Node *fold_expr(Node *node);
+
+static bool is_num(Node *node) {
+    return node->kind == ND_NUM;
+}
+
+static bool fits_int(long val) {
+    return val == (int)val;
+}
+
+// Counts an operator that is removed while its operands are kept.
+static void drop_op(void) {
+    current_fn->folded_nodes++;
+}
+
+// Counts an expression without side effects that is removed entirely.
+static void drop(Node *node) {
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            drop_op();
+            return;
+        case ND_NEG:
+        case ND_ADDR:
+        case ND_DEREF:
+            drop_op();
+            drop(node->lhs);
+            return;
+        default:
+            drop_op();
+            drop(node->lhs);
+            drop(node->rhs);
+            return;
+    }
+}
+
+static bool has_side_effects(Node *node) {
+    switch (node->kind) {
+        case ND_ASSIGN:
+        case ND_FUNCALL:
+            return true;
+        case ND_NUM:
+        case ND_VAR:
+            return false;
+        case ND_NEG:
+        case ND_ADDR:
+        case ND_DEREF:
+            return has_side_effects(node->lhs);
+        default:
+            return has_side_effects(node->lhs) || has_side_effects(node->rhs);
+    }
+}
+
+// Evaluates a binary operator on two constants the way the VM does.
+// Returns false if the result is not an int or the VM would fault, in
+// which case the operator is left for run time.
+static bool eval(NodeKind kind, long a, long b, long *val) {
+    switch (kind) {
+        case ND_ADD:
+            *val = a + b;
+            break;
+        case ND_SUB:
+            *val = a - b;
+            break;
+        case ND_MUL:
+            *val = a * b;
+            break;
+        case ND_DIV:
+            if (b == 0)
+                return false;
+            *val = a / b;
+            break;
+        case ND_EQ:
+            *val = a == b;
+            break;
+        case ND_NE:
+            *val = a != b;
+            break;
+        case ND_LT:
+            *val = a < b;
+            break;
+        case ND_LE:
+            *val = a <= b;
+            break;
+        default:
+            return false;
+    }
+    return fits_int(*val);
+}
+
+// Returns the constant that an ND_ADD or ND_SUB with a constant
+// right-hand side adds to its left-hand side.
+static long addend(Node *node) {
+    return node->kind == ND_ADD ? node->rhs->val : -(long)node->rhs->val;
+}
+
+// Simplifies a binary operator whose operands are already folded
+static Node *fold_binary(Node *node) {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+    long val;
+
+    if (is_num(lhs) && is_num(rhs) && eval(node->kind, lhs->val, rhs->val, &val)) {
+        drop_op();
+        drop(rhs);
+        lhs->val = val;
+        return lhs;
+    }
+
+    // Move a constant operand of + and * to the right. Constants have no
+    // side effects, so the order of evaluation does not matter.
+    if ((node->kind == ND_ADD || node->kind == ND_MUL) && is_num(lhs)) {
+        node->lhs = rhs;
+        node->rhs = lhs;
+        lhs = node->lhs;
+        rhs = node->rhs;
+    }
+
+    if (!is_num(rhs))
+        return node;
+
+    switch (node->kind) {
+        case ND_ADD:
+        case ND_SUB:
+            // x+0 and x-0 are x
+            if (rhs->val == 0) {
+                drop_op();
+                drop(rhs);
+                return lhs;
+            }
+
+            // (x+a)+b is x+(a+b). The inner operator has the same type,
+            // since both add an offset to x.
+            if ((lhs->kind == ND_ADD || lhs->kind == ND_SUB) && is_num(lhs->rhs)) {
+                val = addend(lhs) + addend(node);
+                if (!fits_int(val) || !fits_int(-val))
+                    return node;
+
+                drop_op();
+                drop(rhs);
+                lhs->kind = val < 0 ? ND_SUB : ND_ADD;
+                lhs->rhs->val = val < 0 ? -val : val;
+                return fold_binary(lhs);
+            }
+            return node;
+        case ND_MUL:
+            // x*1 is x
+            if (rhs->val == 1) {
+                drop_op();
+                drop(rhs);
+                return lhs;
+            }
+
+            // x*0 is 0 unless evaluating x has an effect
+            if (rhs->val == 0 && !has_side_effects(lhs)) {
+                drop_op();
+                drop(lhs);
+                return rhs;
+            }
+            return node;
+        case ND_DIV:
+            // x/1 is x
+            if (rhs->val == 1) {
+                drop_op();
+                drop(rhs);
+                return lhs;
+            }
+            return node;
+        default:
+            return node;
+    }
+}
+
+// Folds the target of an assignment
+static Node *fold_lvalue(Node *node) {
+    if (node->kind != ND_DEREF)
+        return node;
+
+    Node *addr = node->lhs = fold_expr(node->lhs);
+
+    // *&x = y stores to x. Once no address of x is taken, x may be
+    // kept in a register, which is stored to with one instruction.
+    if (addr->kind == ND_ADDR) {
+        current_fn->folded_nodes += 2;
+        return addr->lhs;
+    }
+    return node;
+}
+
+static Node *fold_expr(Node *node) {
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            return node;
+        case ND_ADDR: {
+            Node *lhs = node->lhs = fold_expr(node->lhs);
+
+            // &*p is p
+            if (lhs->kind == ND_DEREF) {
+                current_fn->folded_nodes += 2;
+                return lhs->lhs;
+            }
+            return node;
+        }
+        case ND_NEG: {
+            Node *lhs = node->lhs = fold_expr(node->lhs);
+
+            if (is_num(lhs) && fits_int(-(long)lhs->val)) {
+                drop_op();
+                lhs->val = -lhs->val;
+                return lhs;
+            }
+
+            // - -x is x
+            if (lhs->kind == ND_NEG) {
+                drop_op();
+                drop_op();
+                return lhs->lhs;
+            }
+            return node;
+        }
+        case ND_DEREF: {
+            Node *lhs = node->lhs = fold_expr(node->lhs);
+
+            // *&x is x. Once no address of x is taken, x may be kept in
+            // a register, which is loaded with one instruction instead of
+            // adding its offset to R6 and dereferencing the sum.
+            if (lhs->kind == ND_ADDR) {
+                current_fn->folded_nodes += 2;
+                return lhs->lhs;
+            }
+            return node;
+        }
+        case ND_ASSIGN:
+            node->lhs = fold_lvalue(node->lhs);
+            node->rhs = fold_expr(node->rhs);
+            return node;
+        case ND_FUNCALL:
+            for (Node **arg = &node->args; *arg; arg = &(*arg)->next) {
+                Node *next = (*arg)->next;
+                *arg = fold_expr(*arg);
+                (*arg)->next = next;
+            }
+            return node;
+        default:
+            node->lhs = fold_expr(node->lhs);
+            node->rhs = fold_expr(node->rhs);
+            return fold_binary(node);
+    }
+}
+
+static void fold_stmt(Node *node) {
+    switch (node->kind) {
+        case ND_IF:
+            node->cond = fold_expr(node->cond);
+            fold_stmt(node->then);
+            if (node->els)
+                fold_stmt(node->els);
+            return;
+        case ND_FOR:
+            if (node->init)
+                fold_stmt(node->init);
+            if (node->cond)
+                node->cond = fold_expr(node->cond);
+            if (node->inc)
+                node->inc = fold_expr(node->inc);
+            fold_stmt(node->then);
+            return;
+        case ND_BLOCK:
+            for (Node *n = node->body; n; n = n->next)
+                fold_stmt(n);
+            return;
+        case ND_RETURN:
+        case ND_EXPR_STMT:
+            node->lhs = fold_expr(node->lhs);
+            return;
+        default:
+            return;
+    }
+}
+
+void fold_function(Function *fn) {
+    current_fn = fn;
+    if (current_ctx->stats || current_ctx->fold_stats)
+        fn->unfolded = copy_tree(fn->body);
+    fold_stmt(fn->body);
+}
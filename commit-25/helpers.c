@@ -1,7 +1,7 @@
 #include "chibicc.h"
 
 void print_tokens(Token *tok) {
-    for (; tok; tok = tok->next) {
+    for (;; tok++) {
         switch (tok->kind) {
             case TK_PUNCT: {
                 printf("TK_PUNCT\n");
@@ -13,7 +13,7 @@ void print_tokens(Token *tok) {
             }
             case TK_EOF: {
                 printf("TK_EOF\n");
-                break;
+                return;
             }
             default: {
                 printf("TK\n");
@@ -29,7 +29,6 @@ void walk_ast(Node *node, int tablevel) {
             case ND_SUB:
             case ND_MUL:
             case ND_DIV:
-            case ND_NEG:
                 printf("NodeKind: %d\n", node->kind);
                 printf("Left: ");
                 walk_ast(node->lhs, tablevel+1);
@@ -37,6 +36,12 @@ void walk_ast(Node *node, int tablevel) {
                 walk_ast(node->rhs, tablevel+1);
                 printf("\n");
                 return;
+            case ND_NEG:
+                printf("NodeKind: %d\n", node->kind);
+                printf("Left: ");
+                walk_ast(node->lhs, tablevel+1);
+                printf("\n");
+                return;
             case ND_NUM:
                 printf("\t%d\n", node->val);
                 return;
@@ -0,0 +1,134 @@
+// This file prints Yamini instructions as assembly text.
+//
+// Code generation builds a list of instructions per function instead of
+// writing text, so that later passes can work on the instructions. The
+// printer turns the list into the text that the assembler reads.
+
+#include "chibicc.h"
+
+// Room for the text of an instruction other than its names
+#define INST_MAX 64
+
+typedef struct {
+    char *str;
+    int len;
+} Mnemonic;
+
+#define M(s) {s, sizeof(s) - 1}
+
+// Mnemonics, including the separator before the operand
+static Mnemonic mnemonic[] = {
+    [OP_LABEL] = M(""),
+    [OP_LOAD] = M("LOAD "), [OP_LOAD_VAR] = M("LOAD &"), [OP_LOAD_ADDR] = M("LOAD $"),
+    [OP_LOAD_REG] = M("LOAD R"),
+    [OP_POP_VAR] = M("POP &"), [OP_POP_PTR] = M("POP *"), [OP_POP_REG] = M("POP R"),
+    [OP_ADD] = M("ADD"), [OP_SUB] = M("SUB"), [OP_MUL] = M("MUL"), [OP_DIV] = M("DIV"),
+    [OP_NEG] = M("NEG"), [OP_EQU] = M("EQU"), [OP_DEREF] = M("DEREF"),
+    [OP_JMP] = M("JMP "), [OP_JZ] = M("JZ "), [OP_JN] = M("JN "), [OP_CALL] = M("CALL "),
+    [OP_RET] = M("RET"), [OP_SHOW] = M("SHOW"), [OP_HALT] = M("HALT"),
+};
+
+#undef M
+
+static char *put(char *p, char *s, int len) {
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static char *put_int(char *p, int val) {
+    // Digits are produced backwards into the end of a small array.
+    char tmp[16];
+    char *q = tmp + sizeof(tmp);
+    unsigned long v = val < 0 ? -(long)val : val;
+
+    do {
+        *--q = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (val < 0)
+        *--q = '-';
+
+    return put(p, q, tmp + sizeof(tmp) - q);
+}
+
+static char *put_sym(char *p, int sym) {
+    return put(p, current_ctx->sym_names[sym], current_ctx->sym_lens[sym]);
+}
+
+static char *put_label(char *p, Label *label) {
+    *p++ = '%';
+
+    if (label->prefix)
+        p = put(p, label->prefix, strlen(label->prefix));
+
+    if (label->sym >= 0) {
+        if (label->prefix)
+            *p++ = '.';
+        p = put_sym(p, label->sym);
+    }
+
+    if (label->n) {
+        *p++ = '.';
+        p = put_int(p, label->n);
+    }
+    return p;
+}
+
+// Returns the length of the longest name in an instruction
+static int name_len(Inst *inst) {
+    switch (inst->op) {
+        case OP_LOAD_VAR:
+        case OP_LOAD_ADDR:
+        case OP_POP_VAR:
+        case OP_POP_PTR:
+            return strlen(inst->name);
+        case OP_LABEL:
+        case OP_JMP:
+        case OP_JZ:
+        case OP_JN:
+        case OP_CALL:
+            return inst->label->sym >= 0 ? current_ctx->sym_lens[inst->label->sym] : 0;
+        default:
+            return 0;
+    }
+}
+
+static void print_inst(Buffer *b, Inst *inst) {
+    char *start = buf_reserve(b, INST_MAX + name_len(inst));
+    char *p = put(start, mnemonic[inst->op].str, mnemonic[inst->op].len);
+
+    switch (inst->op) {
+        case OP_LOAD:
+            p = put_int(p, inst->val);
+            break;
+        case OP_LOAD_VAR:
+        case OP_LOAD_ADDR:
+        case OP_POP_VAR:
+        case OP_POP_PTR:
+            p = put(p, inst->name, strlen(inst->name));
+            break;
+        case OP_LOAD_REG:
+        case OP_POP_REG:
+            p = put_int(p, inst->reg);
+            break;
+        case OP_LABEL:
+        case OP_JMP:
+        case OP_JZ:
+        case OP_JN:
+        case OP_CALL:
+            p = put_label(p, inst->label);
+            break;
+        default:
+            break;
+    }
+
+    *p++ = '\n';
+    b->len += p - start;
+}
+
+// Appends the text of a list of instructions to a buffer
+void print_code(Buffer *b, Inst *code) {
+    for (Inst *inst = code; inst; inst = inst->next)
+        print_inst(b, inst);
+}
@@ -1,18 +1,189 @@
 #include "chibicc.h"
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "%s: invalid number of arguments\n", argv[0]);
-        return 1;
+static bool opt_stats;
+static bool opt_fold_stats;
+static int opt_j = 1;
+static char *opt_o;
+
+static char *input_path;
+
+static void usage(int status) {
+    fprintf(stderr, "chibicc [ -stats ] [ -fold-stats ] [ -j <threads> ] [ -o <path> ] <file>\n");
+    exit(status);
+}
+
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help"))
+            usage(0);
+
+        if (!strcmp(argv[i], "-stats")) {
+            opt_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fold-stats")) {
+            opt_fold_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-j")) {
+            if (!argv[++i])
+                usage(1);
+            opt_j = atoi(argv[i]);
+            if (opt_j < 1)
+                error("invalid number of threads: %s", argv[i]);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-o")) {
+            if (!argv[++i])
+                usage(1);
+            opt_o = argv[i];
+            continue;
+        }
+
+        if (argv[i][0] == '-' && argv[i][1] != '\0')
+            error("unknown argument: %s", argv[i]);
+
+        if (input_path)
+            error("too many input files");
+
+        input_path = argv[i];
+    }
+
+    if (!input_path)
+        error("no input files");
+}
+
+// Reads a pipe or terminal until EOF into a heap buffer.
+static char *read_stream(FILE *fp, char *path, size_t *len) {
+    char *buf;
+    FILE *out = open_memstream(&buf, len);
+
+    // Read the entire file.
+    for (;;) {
+        char buf2[4096];
+        size_t n = fread(buf2, 1, sizeof(buf2), fp);
+        if (n == 0)
+            break;
+        fwrite(buf2, 1, n, out);
+    }
+
+    if (ferror(fp))
+        error("cannot read %s: %s", path, strerror(errno));
+
+    fclose(out);
+    return buf;
+}
+
+// Returns the contents of a given file and stores its length to *len.
+// "-" means stdin.
+static char *read_file(char *path, size_t *len) {
+    FILE *fp;
+
+    if (strcmp(path, "-") == 0) {
+        fp = stdin;
+    } else {
+        fp = fopen(path, "r");
+        if (!fp)
+            error("cannot open %s: %s", path, strerror(errno));
     }
 
-    Const cons = init_const();
+    // Regular files (including a file redirected to stdin) are mapped
+    // without being copied, everything else is read.
+    struct stat st;
+    char *buf = NULL;
+    bool have_st = fstat(fileno(fp), &st) == 0;
 
-    Token *tok = tokenize(argv[1]);
-    Function *prog = parse(tok, &cons);
+    if (have_st && S_ISDIR(st.st_mode))
+        error("cannot read %s: %s", path, strerror(EISDIR));
 
-    // Traverse the AST to emit assembly.
-    codegen(prog, &cons);
+    if (have_st && S_ISREG(st.st_mode) && st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (buf == MAP_FAILED)
+            buf = NULL;
+        else
+            *len = st.st_size;
+    }
+
+    if (!buf)
+        buf = read_stream(fp, path, len);
+
+    if (fp != stdin)
+        fclose(fp);
+    return buf;
+}
+
+// Opens a temporary file next to `path`, so that it can be renamed over
+// `path` once the output is complete. Readers of `path` never see a
+// partial file, and a failed compile leaves an existing one untouched.
+// Anything but a regular file, such as a pipe or a device, is written
+// directly and *tmp is set to NULL.
+static FILE *open_output(char *path, char **tmp) {
+    struct stat st;
+    if (stat(path, &st) == 0 && !S_ISREG(st.st_mode)) {
+        *tmp = NULL;
+        FILE *out = fopen(path, "w");
+        if (!out)
+            error("cannot open output file %s: %s", path, strerror(errno));
+        return out;
+    }
+
+    *tmp = malloc(strlen(path) + 8);
+    sprintf(*tmp, "%s.XXXXXX", path);
+
+    int fd = mkstemp(*tmp);
+    if (fd == -1)
+        error("cannot open output file %s: %s", path, strerror(errno));
+
+    // mkstemp() creates the file with mode 0600.
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+
+    return fdopen(fd, "w");
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    size_t len;
+    char *src = read_file(input_path, &len);
+
+    Compiler *ctx = new_compiler();
+    ctx->filename = strcmp(input_path, "-") == 0 ? "<stdin>" : input_path;
+    ctx->nthreads = opt_j;
+    if (opt_stats)
+        ctx->stats = stderr;
+    if (opt_fold_stats)
+        ctx->fold_stats = stderr;
+
+    FILE *out = stdout;
+    char *tmp = NULL;
+    if (opt_o)
+        out = open_output(opt_o, &tmp);
+
+    if (compile(ctx, src, len, out)) {
+        fputs(ctx->errmsg, stderr);
+        if (tmp)
+            unlink(tmp);
+        exit(1);
+    }
+
+    if (out != stdout && fclose(out)) {
+        if (tmp)
+            unlink(tmp);
+        error("cannot write %s: %s", opt_o, strerror(errno));
+    }
+
+    if (tmp) {
+        if (rename(tmp, opt_o)) {
+            unlink(tmp);
+            error("cannot rename %s to %s: %s", tmp, opt_o, strerror(errno));
+        }
+    }
 
+    free_compiler(ctx);
     return 0;
-}
\ No newline at end of file
+}
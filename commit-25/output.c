@@ -0,0 +1,160 @@
+// This file contains the output subsystem.
+//
+// Code is printed into Buffers, which grow in memory. The printer in
+// ir.c writes the text of instructions straight into the space that
+// buf_reserve() returns, without going through stdio.
+//
+// Filled buffers are handed to a Writer, which writes them out in large
+// chunks with write(2), regardless of how the output stream is buffered.
+// A threaded writer does the writing on its own thread, so that file I/O
+// overlaps with code generation.
+
+#include "chibicc.h"
+
+// Number of buffers a threaded writer may hold before writer_put()
+// waits, which bounds memory when the output is slower than codegen
+#define MAX_PENDING (sizeof(((Writer *)0)->pending) / sizeof(Buffer))
+
+// Makes room for `len` more bytes and returns where they go. The caller
+// writes them and advances b->len.
+char *buf_reserve(Buffer *b, size_t len) {
+    if (b->len + len <= b->cap)
+        return b->data + b->len;
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + len)
+        cap *= 2;
+
+    b->data = realloc(b->data, cap);
+    if (!b->data)
+        error("out of memory");
+    b->cap = cap;
+    return b->data + b->len;
+}
+
+void buf_free(Buffer *b) {
+    free(b->data);
+    *b = (Buffer){};
+}
+
+// Writes `len` bytes to the output. Returns false on failure.
+static bool write_out(Writer *w, char *p, size_t len) {
+    w->nbytes += len;
+
+    if (w->fd < 0) {
+        w->nwrites++;
+        return fwrite(p, 1, len, w->out) == len;
+    }
+
+    while (len > 0) {
+        ssize_t n = write(w->fd, p, len);
+        w->nwrites++;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void *writer_main(void *arg) {
+    Writer *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->npending == 0 && !w->closing)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->npending == 0)
+            break;
+
+        Buffer b = w->pending[0];
+        pthread_mutex_unlock(&w->lock);
+
+        bool ok = write_out(w, b.data, b.len);
+
+        pthread_mutex_lock(&w->lock);
+        if (!ok && !w->err)
+            w->err = errno;
+
+        // Keep the memory for writer_put() to hand back out.
+        w->npending--;
+        memmove(w->pending, w->pending + 1, sizeof(Buffer) * w->npending);
+        if (w->spare.data)
+            free(b.data);
+        else
+            w->spare = (Buffer){b.data, 0, b.cap};
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Creates a writer for `out`. Anything already buffered in `out` is
+// flushed first, since the writer bypasses the stream's buffer when it
+// has a file descriptor.
+Writer *new_writer(FILE *out, bool threaded) {
+    Writer *w = calloc(1, sizeof(Writer));
+    w->out = out;
+
+    fflush(out);
+    w->fd = fileno(out);
+
+    if (threaded) {
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        w->threaded = !pthread_create(&w->thread, NULL, writer_main, w);
+    }
+    return w;
+}
+
+// Writes out the contents of `b` and empties it. A threaded writer
+// takes over the memory and gives `b` a spare buffer instead.
+void writer_put(Writer *w, Buffer *b) {
+    if (b->len == 0)
+        return;
+
+    if (!w->threaded) {
+        if (!write_out(w, b->data, b->len) && !w->err)
+            w->err = errno;
+        b->len = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->npending == MAX_PENDING)
+        pthread_cond_wait(&w->cond, &w->lock);
+
+    w->pending[w->npending++] = *b;
+    *b = w->spare;
+    w->spare = (Buffer){};
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Waits until everything has been written. Returns 0 on success or an
+// errno value. Closing again returns the same result. The writer is
+// freed with free() afterwards, so that its counters can still be read.
+int writer_close(Writer *w) {
+    if (w->closed)
+        return w->err;
+    w->closed = true;
+
+    if (w->threaded) {
+        pthread_mutex_lock(&w->lock);
+        w->closing = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+    }
+
+    if (fflush(w->out) && !w->err)
+        w->err = errno;
+
+    buf_free(&w->spare);
+    return w->err;
+}
@@ -10,7 +10,8 @@
 // multiple return values, the remaining tokens are returned to the
 // caller via a pointer argument.
 //
-// Input tokens are represented by a linked list. Unlike many recursive
+// Input tokens are represented by an array terminated by a TK_EOF token,
+// so the token following `tok` is `tok + 1`. Unlike many recursive
 // descent parsers, we don't have the notion of the "input token stream".
 // Most parsing functions don't change the global state of the parser.
 // So it is very easy to lookahead arbitrary number of tokens in this
@@ -18,93 +19,303 @@
 
 #include "chibicc.h"
 
-// All local variable instances created during parsing are
-// accumulated to this list.
-Obj *locals;
-
-static Type *declspec(Token **rest, Token *tok, Const *cons);
-static Type *declarator(Token **rest, Token *tok, Type *ty, Const *cons);
-static Node *declaration(Token **rest, Token *tok, Const *cons);
-static Node *compound_stmt(Token **rest, Token *tok, Const *cons);
-static Node *stmt(Token **rest, Token *tok, Const *cons);
-static Node *expr_stmt(Token **rest, Token *tok, Const *cons);
-static Node *expr(Token **rest, Token *tok, Const *cons);
-static Node *assign(Token **rest, Token *tok, Const *cons);
-static Node *equality(Token **rest, Token *tok, Const *cons);
-static Node *relational(Token **rest, Token *tok, Const *cons);
-static Node *add(Token **rest, Token *tok, Const *cons);
-static Node *mul(Token **rest, Token *tok, Const *cons);
-static Node *unary(Token **rest, Token *tok, Const *cons);
-static Node *primary(Token **rest, Token *tok, Const *cons);
+// The function being parsed. Its local variables are accumulated to
+// current_fn->locals. The parser state is per thread, so that functions
+// can be parsed at the same time.
+static _Thread_local Function *current_fn;
+
+// The tables below are scratch space for the function being parsed.
+// They are allocated from its arena, so nothing is left to free when a
+// parse fails or a pool thread exits.
+//
+// Local variables visible at the current point of the parse. var_table
+// is an open-addressing hash table from a symbol id to the innermost
+// variable with that name. A slot, once used, keeps its symbol for the
+// rest of the function and has a NULL var while the name is out of scope.
+typedef struct {
+    int sym;    // -1 if the slot is empty
+    Obj *var;
+} VarEntry;
+
+static _Thread_local VarEntry *var_table;
+static _Thread_local int var_table_cap;
+static _Thread_local int var_table_used;
+
+// Each declaration pushes the binding it replaces, so that leaving a
+// scope can restore the bindings of the enclosing one. scope_marks holds
+// the height of the undo stack at the start of each open scope.
+typedef struct {
+    int slot;
+    Obj *var;
+} ScopeUndo;
+
+static _Thread_local ScopeUndo *scope_undo;
+static _Thread_local int scope_undo_len;
+static _Thread_local int scope_undo_cap;
+
+static _Thread_local int *scope_marks;
+static _Thread_local int scope_depth;
+static _Thread_local int scope_marks_cap;
+
+static Type *declspec(Token **rest, Token *tok);
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name);
+static Node *declaration(Token **rest, Token *tok);
+static Node *compound_stmt(Token **rest, Token *tok);
+static Node *stmt(Token **rest, Token *tok);
+static Node *expr_stmt(Token **rest, Token *tok);
+static Node *expr(Token **rest, Token *tok);
+static Node *assign(Token **rest, Token *tok);
+static Node *binary(Token **rest, Token *tok, int min_prec);
+static Node *unary(Token **rest, Token *tok);
+static Node *primary(Token **rest, Token *tok);
+
+// Returns a copy of the array `p` of `len` elements of `size` bytes with
+// room for `cap` elements. The old array stays in the arena.
+static void *grow_array(void *p, int len, int cap, size_t size) {
+    void *q = arena_alloc(&current_fn->arena, size * cap);
+    if (len)
+        memcpy(q, p, size * len);
+    return q;
+}
+
+static uint32_t hash_sym(int sym) {
+    return (uint32_t)sym * 2654435761u;
+}
+
+// Returns the slot for `sym` in var_table, claiming an empty one if the
+// name hasn't been seen in this function.
+static int var_slot(int sym) {
+    int i = hash_sym(sym) & (var_table_cap - 1);
+    while (var_table[i].sym != sym && var_table[i].sym != -1)
+        i = (i + 1) & (var_table_cap - 1);
+    return i;
+}
+
+static void grow_var_table(void) {
+    VarEntry *old = var_table;
+    int oldcap = var_table_cap;
+
+    var_table_cap = oldcap ? oldcap * 2 : 16;
+    var_table = grow_array(NULL, 0, var_table_cap, sizeof(VarEntry));
+    for (int i = 0; i < var_table_cap; i++)
+        var_table[i].sym = -1;
+
+    for (int i = 0; i < oldcap; i++)
+        if (old[i].sym != -1)
+            var_table[var_slot(old[i].sym)] = old[i];
+
+    // Rehashing moves the slots recorded for the open scopes.
+    for (int i = 0; i < scope_undo_len; i++)
+        scope_undo[i].slot = var_slot(old[scope_undo[i].slot].sym);
+}
+
+// Starts empty tables for current_fn.
+static void reset_var_table(void) {
+    var_table = NULL;
+    var_table_cap = 0;
+    var_table_used = 0;
+    scope_undo = NULL;
+    scope_undo_len = 0;
+    scope_undo_cap = 0;
+    scope_marks = NULL;
+    scope_depth = 0;
+    scope_marks_cap = 0;
+    grow_var_table();
+}
+
+static void enter_scope(void) {
+    if (scope_depth == scope_marks_cap) {
+        scope_marks_cap = scope_marks_cap ? scope_marks_cap * 2 : 16;
+        scope_marks = grow_array(scope_marks, scope_depth, scope_marks_cap, sizeof(int));
+    }
+
+    scope_marks[scope_depth++] = scope_undo_len;
+}
+
+static void leave_scope(void) {
+    int mark = scope_marks[--scope_depth];
+    while (scope_undo_len > mark) {
+        ScopeUndo *u = &scope_undo[--scope_undo_len];
+        var_table[u->slot].var = u->var;
+    }
+}
+
+// Makes `var` visible until the end of the current scope
+static void push_var(Obj *var) {
+    if (var_table_used >= var_table_cap / 2)
+        grow_var_table();
+
+    int slot = var_slot(var->sym);
+    if (var_table[slot].sym == -1) {
+        var_table[slot].sym = var->sym;
+        var_table[slot].var = NULL;
+        var_table_used++;
+    }
+
+    if (scope_undo_len == scope_undo_cap) {
+        scope_undo_cap = scope_undo_cap ? scope_undo_cap * 2 : 64;
+        scope_undo = grow_array(scope_undo, scope_undo_len, scope_undo_cap, sizeof(ScopeUndo));
+    }
+
+    scope_undo[scope_undo_len++] = (ScopeUndo){slot, var_table[slot].var};
+    var_table[slot].var = var;
+}
 
 // Find a local variable by name
 static Obj *find_var(Token *tok) {
-    for (Obj *var = locals; var; var = var->next) {
-        if (strlen(var->name) == tok->len && !strncmp(tok->loc, var->name, tok->len))
-            return var;
-    }
+    VarEntry *e = &var_table[var_slot(tok->sym)];
+    return e->sym == -1 ? NULL : e->var;
+}
 
-    return NULL;
+// Returns the size of a node of the given kind: the common header plus
+// the part of the union that the kind uses.
+static size_t node_size(NodeKind kind) {
+    switch (kind) {
+        case ND_NEG:
+        case ND_ADDR:
+        case ND_DEREF:
+        case ND_RETURN:
+        case ND_EXPR_STMT:
+            return offsetof(Node, lhs) + sizeof(Node *);
+        case ND_IF:
+            return offsetof(Node, els) + sizeof(Node *);
+        case ND_FOR:
+            return offsetof(Node, inc) + sizeof(Node *);
+        case ND_BLOCK:
+            return offsetof(Node, body) + sizeof(Node *);
+        case ND_FUNCALL:
+            return offsetof(Node, args) + sizeof(Node *);
+        case ND_VAR:
+            return offsetof(Node, var) + sizeof(Obj *);
+        case ND_NUM:
+            return offsetof(Node, val) + sizeof(int);
+        default:
+            return offsetof(Node, rhs) + sizeof(Node *);
+    }
 }
 
 static Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&current_fn->arena, node_size(kind));
+    current_fn->nnodes++;
     node->kind = kind;
     node->tok = tok;
     return node;
 }
 
+static Node *copy_list(Node *node);
+
+// Returns a copy of the tree under `node`. The copy is not counted as
+// created by the parser.
+Node *copy_tree(Node *node) {
+    if (!node)
+        return NULL;
+
+    size_t size = node_size(node->kind);
+    Node *copy = arena_alloc(&current_fn->arena, size);
+    memcpy(copy, node, size);
+    copy->next = NULL;
+
+    switch (node->kind) {
+        case ND_NUM:
+        case ND_VAR:
+            break;
+        case ND_IF:
+            copy->cond = copy_tree(node->cond);
+            copy->then = copy_tree(node->then);
+            copy->els = copy_tree(node->els);
+            break;
+        case ND_FOR:
+            copy->init = copy_tree(node->init);
+            copy->cond = copy_tree(node->cond);
+            copy->inc = copy_tree(node->inc);
+            copy->then = copy_tree(node->then);
+            break;
+        case ND_BLOCK:
+            copy->body = copy_list(node->body);
+            break;
+        case ND_FUNCALL:
+            copy->args = copy_list(node->args);
+            break;
+        default:
+            copy->lhs = copy_tree(node->lhs);
+            if (size > offsetof(Node, rhs))
+                copy->rhs = copy_tree(node->rhs);
+            break;
+    }
+    return copy;
+}
+
+static Node *copy_list(Node *node) {
+    Node head = {};
+    Node *cur = &head;
+    for (; node; node = node->next)
+        cur = cur->next = copy_tree(node);
+    return head.next;
+}
+
+// Assigns the type of a newly built expression node. Its operands were
+// typed when they were built, so type inference visits each node once.
+static Node *typed(Node *node) {
+    add_type(node);
+    current_fn->type_visits++;
+    return node;
+}
+
 static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
     Node *node = new_node(kind, tok);
     node->lhs = lhs;
     node->rhs = rhs;
-    return node;
+    return typed(node);
 }
 
 static Node *new_unary(NodeKind kind, Node *lhs, Token *tok) {
     Node *node = new_node(kind, tok);
     node->lhs = lhs;
-    return node;
+    return typed(node);
 }
 
 static Node *new_num(int val, Token *tok) {
     Node *node = new_node(ND_NUM, tok);
     node->val = val;
-    return node;
+    return typed(node);
 }
 
 static Node *new_var_node(Obj *var, Token *tok) {
     Node *node = new_node(ND_VAR, tok);
     node->var = var;
-    return node;
+    return typed(node);
 }
 
-static Obj *new_lvar(char *name, Type *ty) {
-    Obj *var = calloc(1, sizeof(Obj));
-    var->name = name;
+static Obj *new_lvar(int sym, Type *ty) {
+    Obj *var = arena_alloc(&current_fn->arena, sizeof(Obj));
+    var->sym = sym;
     var->ty = ty;
-    var->next = locals;
-    locals = var;
+    var->next = current_fn->locals;
+    current_fn->locals = var;
+    push_var(var);
     return var;
 }
 
-static char *get_ident(Token *tok) {
+static int get_ident(Token *tok) {
     if (tok->kind != TK_IDENT) 
         error_tok(tok, "Expected an identifier");
 
-    return strndup(tok->loc, tok->len);
+    return tok->sym;
 }
 
 // declspec = "int"
-static Type *declspec(Token **rest, Token *tok, Const *cons) {
-    *rest = skip(tok, "int");
+static Type *declspec(Token **rest, Token *tok) {
+    if (tok->keyword != KW_INT)
+        error_tok(tok, "Expected 'int'");
+
+    *rest = tok + 1;
     return ty_int;
 }
 
 // type-suffix = ("(" func-params)?
-static Type *type_suffix(Token **rest, Token *tok, Type *ty, Const *cons) {
-    if (equal(tok, "(")) {
-        *rest = skip(tok->next, ")");
+static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
+    if (tok->punct == PU_LPAREN) {
+        *rest = skip(tok + 1, PU_RPAREN);
         return func_type(ty);
     }
 
@@ -113,45 +324,48 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty, Const *cons) {
 }
 
 // declarator = "*"* ident type-suffix
-static Type *declarator(Token **rest, Token *tok, Type *ty, Const *cons) {
-    while (consume(&tok, tok, "*")) 
+//
+// Types are shared, so the declared name is returned through `name`
+// rather than stored in the type.
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name) {
+    while (consume(&tok, tok, PU_STAR)) 
         ty = pointer_to(ty);
     
     if (tok->kind != TK_IDENT)
         error_tok(tok, "Expected a variable name");
 
-    ty = type_suffix(rest, tok->next, ty, cons);
-    ty->name = tok;
-    return ty;
+    *name = tok;
+    return type_suffix(rest, tok + 1, ty);
 }
 
 // declaration = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
-static Node *declaration(Token **rest, Token *tok, Const *cons) {
-    Type *basety = declspec(&tok, tok, cons);
+static Node *declaration(Token **rest, Token *tok) {
+    Type *basety = declspec(&tok, tok);
 
     Node head = {};
     Node *cur = &head;
     int i = 0;
 
-    while (!equal(tok, ";")) {
+    while (tok->punct != PU_SEMICOLON) {
         if (i++ > 0) 
-            tok = skip(tok, ";");
+            tok = skip(tok, PU_COMMA);
 
-        Type *ty = declarator(&tok, tok, basety, cons);
-        Obj *var = new_lvar(get_ident(ty->name), ty);
+        Token *name;
+        Type *ty = declarator(&tok, tok, basety, &name);
+        Obj *var = new_lvar(get_ident(name), ty);
 
-        if (!equal(tok, "="))
+        if (tok->punct != PU_ASSIGN)
             continue;
 
-        Node *lhs = new_var_node(var, ty->name);
-        Node *rhs = assign(&tok, tok->next, cons);
+        Node *lhs = new_var_node(var, name);
+        Node *rhs = assign(&tok, tok + 1);
         Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
         cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
     }
 
     Node *node = new_node(ND_BLOCK, tok);
     node->body = head.next;
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
 }
 
@@ -161,179 +375,120 @@ static Node *declaration(Token **rest, Token *tok, Const *cons) {
 //      | "while" "(" expr ")" stmt
 //      | "{" compound-stmt 
 //      | expr-stmt
-static Node *stmt(Token **rest, Token *tok, Const *cons) {
-    if (equal(tok, "return")) {
-        Node *node = new_node(ND_RETURN, tok);
-        node->lhs = expr(&tok, tok->next, cons);
-        *rest = skip(tok, ";");
-        return node;
-    }
+static Node *stmt(Token **rest, Token *tok) {
+    switch (tok->keyword) {
+        case KW_RETURN: {
+            Node *node = new_node(ND_RETURN, tok);
+            node->lhs = expr(&tok, tok + 1);
+            *rest = skip(tok, PU_SEMICOLON);
+            return node;
+        }
+        case KW_IF: {
+            Node *node = new_node(ND_IF, tok);
+            tok = skip(tok + 1, PU_LPAREN);
+            node->cond = expr(&tok, tok);
+            tok = skip(tok, PU_RPAREN);
+            node->then = stmt(&tok, tok);
+            if (tok->keyword == KW_ELSE) 
+                node->els = stmt(&tok, tok + 1);
+            *rest = tok;
+            return node;
+        }
+        case KW_FOR: {
+            Node *node = new_node(ND_FOR, tok);
+            tok = skip(tok + 1, PU_LPAREN);
 
-    if (equal(tok, "if")) {
-        Node *node = new_node(ND_IF, tok);
-        tok = skip(tok->next, "(");
-        node->cond = expr(&tok, tok, cons);
-        tok = skip(tok, ")");
-        node->then = stmt(&tok, tok, cons);
-        if (equal(tok, "else")) 
-            node->els = stmt(&tok, tok->next, cons);
-        *rest = tok;
-        return node;
-    }
+            node->init = expr_stmt(&tok, tok);
 
-    if (equal(tok, "for")) {
-        Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
+            if (tok->punct != PU_SEMICOLON) {
+                node->cond = expr(&tok, tok);
+            }
+            tok = skip(tok, PU_SEMICOLON);
 
-        node->init = expr_stmt(&tok, tok, cons);
+            if (tok->punct != PU_RPAREN) {
+                node->inc = expr(&tok, tok);
+            }
+            tok = skip(tok, PU_RPAREN);
 
-        if (!equal(tok, ";")) {
-            node->cond = expr(&tok, tok, cons);
+            node->then = stmt(rest, tok);
+            return node;
         }
-        tok = skip(tok, ";");
-
-        if (!equal(tok, ")")) {
-            node->inc = expr(&tok, tok, cons);
+        case KW_WHILE: {
+            Node *node = new_node(ND_FOR, tok);
+            tok = skip(tok + 1, PU_LPAREN);
+            node->cond = expr(&tok, tok);
+            tok = skip(tok, PU_RPAREN);
+            node->then = stmt(rest, tok);
+            return node;
         }
-        tok = skip(tok, ")");
-
-        node->then = stmt(rest, tok, cons);
-        return node;
-    }
-
-    if (equal(tok, "while")) {
-        Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
-        node->cond = expr(&tok, tok, cons);
-        tok = skip(tok, ")");
-        node->then = stmt(rest, tok, cons);
-        return node;
+        default:
+            break;
     }
 
-    if (equal(tok, "{"))
-        return compound_stmt(rest, tok->next, cons);
+    if (tok->punct == PU_LBRACE)
+        return compound_stmt(rest, tok + 1);
 
-    return expr_stmt(rest, tok, cons);
+    return expr_stmt(rest, tok);
 }
 
 // compound-stmt = (declaration | stmt)* "}"
-static Node *compound_stmt(Token **rest, Token *tok, Const *cons) {
+static Node *compound_stmt(Token **rest, Token *tok) {
     Node *node = new_node(ND_BLOCK, tok);
 
+    enter_scope();
+
     Node head = {};
     Node *cur = &head;
-    while (!equal(tok, "}")) {
-        if (equal(tok, "int"))
-            cur = cur->next = declaration(&tok, tok, cons);
+    while (tok->punct != PU_RBRACE) {
+        if (tok->keyword == KW_INT)
+            cur = cur->next = declaration(&tok, tok);
         else
-            cur = cur->next = stmt(&tok, tok, cons);
-
-        add_type(cur);
+            cur = cur->next = stmt(&tok, tok);
     }
 
+    leave_scope();
+
     node->body = head.next;
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
 }
 
 // expr-stmt = expr? ";"
-static Node *expr_stmt(Token **rest, Token *tok, Const *cons) {
-    if (equal(tok, ";")) {
-        *rest = tok->next;
+static Node *expr_stmt(Token **rest, Token *tok) {
+    if (tok->punct == PU_SEMICOLON) {
+        *rest = tok + 1;
         return new_node(ND_BLOCK, tok);
     }
 
     Node *node = new_node(ND_EXPR_STMT, tok);
-    node->lhs = expr(&tok, tok, cons);
-    *rest = skip(tok, ";");
+    node->lhs = expr(&tok, tok);
+    *rest = skip(tok, PU_SEMICOLON);
     return node;
 }
 
 // expr = assign
-static Node *expr(Token **rest, Token *tok, Const *cons) {
-    return  assign(rest, tok, cons);
+static Node *expr(Token **rest, Token *tok) {
+    return  assign(rest, tok);
 }
 
-// assign = equality ("=" equality)?
-static Node *assign(Token **rest, Token *tok, Const *cons) {
-    Node *node = equality(&tok, tok, cons);
+// assign = binary ("=" binary)?
+static Node *assign(Token **rest, Token *tok) {
+    Node *node = binary(&tok, tok, 1);
 
-    if (equal(tok, "=")) {
-        node = new_binary(ND_ASSIGN, node, equality(&tok, tok->next, cons), tok);
+    if (tok->punct == PU_ASSIGN) {
+        node = new_binary(ND_ASSIGN, node, binary(&tok, tok + 1, 1), tok);
     }
 
     *rest = tok;
     return node;
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-static Node *equality(Token **rest, Token *tok, Const *cons) {
-    Node *node = relational(&tok, tok, cons);
-
-    for (;;) {
-        Token *start = tok;
-
-        if (equal(tok, "==")) {
-            node = new_binary(ND_EQ, node, relational(&tok, tok->next, cons), start);
-            continue;
-        }
-
-        if (equal(tok, "!=")) {
-            cons->requires_ne_function = true;
-            node = new_binary(ND_NE, node, relational(&tok, tok->next, cons), start);
-            continue;
-        }
-
-        *rest = tok;
-        return node;
-    }
-}
-
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(Token **rest, Token *tok, Const *cons) {
-    Node *node = add(&tok, tok, cons);
-
-    for (;;) {
-        Token *start = tok;
-
-        if (equal(tok, "<")) {
-            cons->requires_le_function = true;
-            node = new_binary(ND_LT, node, add(&tok, tok->next, cons), start);
-            continue;
-        }
-
-        if (equal(tok, "<=")) {
-            cons->requires_leq_function = true;
-            node = new_binary(ND_LE, node, add(&tok, tok->next, cons), start);
-            continue;
-        }
-
-        if (equal(tok, ">")) {
-            cons->requires_le_function = true;
-            node = new_binary(ND_LT, add(&tok, tok->next, cons), node, start);
-            continue;
-        }
-
-        if (equal(tok, ">=")) {
-            cons->requires_leq_function = true;
-            node = new_binary(ND_LE, add(&tok, tok->next, cons), node, start);
-            continue;
-        }
-
-        *rest = tok;
-        return node;
-    }
-}
-
 // In C, `+` operator is overloaded to perform the pointer arithmetic.
 // If p is a pointer, p+n adds not n but sizeof(*p)*n to the value of p,
 // so that p+n points to the location n elements (not bytes) ahead of p.
 // In other words, we need to scale an integer value before adding to a
 // pointer value. This function takes care of the scaling.
 static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
-    add_type(lhs);
-    add_type(rhs);
-
     // num + num
     if (is_integer(lhs->ty) && is_integer(rhs->ty)) 
         return new_binary(ND_ADD, lhs, rhs, tok);
@@ -355,9 +510,6 @@ static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
 
 // Like `+`, `-` is overloaded for the pointer type.
 static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
-    add_type(lhs);
-    add_type(rhs);
-
     // num - num
     if (is_integer(lhs->ty) && is_integer(rhs->ty)) 
         return new_binary(ND_SUB, lhs, rhs, tok);
@@ -365,7 +517,6 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
     // ptr - num
     if (lhs->ty->base && is_integer(rhs->ty)) {
         rhs = new_binary(ND_MUL, rhs, new_num(8, tok), tok);
-        add_type(rhs);
         Node *node = new_binary(ND_SUB, lhs, rhs, tok);
         node->ty = lhs->ty;
         return node;
@@ -382,102 +533,120 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
     return NULL;
 }
 
-// add = mul ("+" mul | "-" mul)*
-static Node *add(Token **rest, Token *tok, Const *cons) {
-    Node *node = mul(&tok, tok, cons);
-
-    for (;;) {
-        Token *start = tok;
-
-        if (equal(tok, "+")) {
-            node = new_add(node, mul(&tok, tok->next, cons), start);
-            continue;
-        }
-
-        if (equal(tok, "-")) {
-            node = new_sub(node, mul(&tok, tok->next, cons), start);
-            continue;
-        }
-
-        *rest = tok;
-        return node;
+// Binary operators, indexed by punctuator. An operator binds tighter
+// than those with a lower precedence; 0 means "not a binary operator".
+// `a > b` and `a >= b` are built as `b < a` and `b <= a`.
+static struct {
+    int prec;
+    NodeKind kind;
+    bool swap;
+} binops[PU_OTHER + 1] = {
+    [PU_EQ] = {1, ND_EQ},
+    [PU_NE] = {1, ND_NE},
+    [PU_LT] = {2, ND_LT},
+    [PU_LE] = {2, ND_LE},
+    [PU_GT] = {2, ND_LT, true},
+    [PU_GE] = {2, ND_LE, true},
+    [PU_PLUS] = {3, ND_ADD},
+    [PU_MINUS] = {3, ND_SUB},
+    [PU_STAR] = {4, ND_MUL},
+    [PU_SLASH] = {4, ND_DIV},
+};
+
+static Node *new_binop(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
+    switch (kind) {
+        case ND_ADD:
+            return new_add(lhs, rhs, tok);
+        case ND_SUB:
+            return new_sub(lhs, rhs, tok);
+        default:
+            return new_binary(kind, lhs, rhs, tok);
     }
 }
 
-// mul = unary ("*" unary | "/" unary)*
-static Node *mul(Token **rest, Token *tok, Const *cons) {
-    Node *node = unary(&tok, tok, cons);
+// binary = unary (binop unary)*
+// binop  = "==" | "!=" | "<" | "<=" | ">" | ">=" | "+" | "-" | "*" | "/"
+//
+// Binary operators are parsed by precedence climbing: this function
+// reads operators binding at least as tight as `min_prec` and recurses
+// only for a tighter-binding right-hand side. All operators are
+// left-associative.
+static Node *binary(Token **rest, Token *tok, int min_prec) {
+    Node *node = unary(&tok, tok);
 
     for (;;) {
-        Token *start = tok;
+        int prec = binops[tok->punct].prec;
+        if (prec == 0 || prec < min_prec)
+            break;
 
-        if (equal(tok, "*")) {
-            node = new_binary(ND_MUL, node, unary(&tok, tok->next, cons), start);
-            continue;
-        }
-
-        if (equal(tok, "/")) {
-            node = new_binary(ND_DIV, node, unary(&tok, tok->next, cons), start);
-            continue;
-        }
+        Token *start = tok;
+        Node *rhs = binary(&tok, tok + 1, prec + 1);
 
-        *rest = tok;
-        return node;
+        if (binops[start->punct].swap)
+            node = new_binop(binops[start->punct].kind, rhs, node, start);
+        else
+            node = new_binop(binops[start->punct].kind, node, rhs, start);
     }
+
+    *rest = tok;
+    return node;
 }
 
 // unary = ("+" | "-" | "*" | "&") unary | primary
-static Node *unary(Token **rest, Token *tok, Const *cons) {
-    if (equal(tok, "+")) 
-        return unary(rest, tok->next, cons);
-    
-    if (equal(tok, "-"))
-        return new_unary(ND_NEG, unary(rest, tok->next, cons), tok);
-
-    if (equal(tok, "*"))
-        return new_unary(ND_DEREF, unary(rest, tok->next, cons), tok);
-
-    if (equal(tok, "&"))
-        return new_unary(ND_ADDR, unary(rest, tok->next, cons), tok);
-
-    return primary(rest, tok, cons);
+static Node *unary(Token **rest, Token *tok) {
+    switch (tok->punct) {
+        case PU_PLUS:
+            return unary(rest, tok + 1);
+        case PU_MINUS:
+            return new_unary(ND_NEG, unary(rest, tok + 1), tok);
+        case PU_STAR:
+            return new_unary(ND_DEREF, unary(rest, tok + 1), tok);
+        case PU_AMP: {
+            Node *lhs = unary(rest, tok + 1);
+            if (lhs->kind != ND_VAR && lhs->kind != ND_DEREF)
+                error_tok(tok + 1, "Not an lvalue!");
+            return new_unary(ND_ADDR, lhs, tok);
+        }
+        default:
+            return primary(rest, tok);
+    }
 }
 
 // funcall = ident "(" (assign ("," assign)*)? ")"
-static Node *funcall(Token **rest, Token *tok, Const *cons) {
+static Node *funcall(Token **rest, Token *tok) {
     Token *start = tok;
-    tok = tok->next->next;
+    tok = tok + 2;
 
     Node head = {};
     Node *cur = &head;
 
-    while (!equal(tok, ")")) {
+    while (tok->punct != PU_RPAREN) {
         if (cur != &head)
-        tok = skip(tok, ",");
-        cur = cur->next = assign(&tok, tok, cons);
+        tok = skip(tok, PU_COMMA);
+        cur = cur->next = assign(&tok, tok);
     }
 
-    *rest = skip(tok, ")");
+    *rest = skip(tok, PU_RPAREN);
 
     Node *node = new_node(ND_FUNCALL, start);
-    node->funcname = strndup(start->loc, start->len);
+    node->funcsym = start->sym;
     node->args = head.next;
-    return node;
+    return typed(node);
 }
 
 // primary = "(" expr ")" | ident func-args? | num
 // args = "(" ")"
-static Node *primary(Token **rest, Token *tok, Const *cons) {
-    if (equal(tok, "(")) {
-        Node *node = expr(&tok, tok->next, cons);
-        *rest = skip(tok, ")");
+static Node *primary(Token **rest, Token *tok) {
+    if (tok->punct == PU_LPAREN) {
+        Node *node = expr(&tok, tok + 1);
+        *rest = skip(tok, PU_RPAREN);
         return node;
     }
 
     if (tok->kind == TK_IDENT) {
         // Function call
-        if (equal(tok->next, "(")) {
-            return funcall(rest, tok, cons);
+        if ((tok + 1)->punct == PU_LPAREN) {
+            return funcall(rest, tok);
         }
 
         // Variable
@@ -485,13 +654,13 @@ static Node *primary(Token **rest, Token *tok, Const *cons) {
         if (!var) 
             error_tok(tok, "Unidentified variable");
         
-        *rest = tok->next;
+        *rest = tok + 1;
         return new_var_node(var, tok);
     }
 
     if (tok->kind == TK_NUM) {
         Node *node = new_num(tok->val, tok);
-        *rest = tok->next;
+        *rest = tok + 1;
         return node;
     }
 
@@ -499,29 +668,113 @@ static Node *primary(Token **rest, Token *tok, Const *cons) {
     return NULL;
 }
 
-static Function *function(Token **rest, Token *tok, Const *cons) {
-    Type *ty = declspec(&tok, tok, cons);
-    ty = declarator(&tok, tok, ty, cons);
+static void function(Token **rest, Token *tok, Function *fn) {
+    current_fn = fn;
+    reset_var_table();
+
+    Token *name;
+    Type *ty = declspec(&tok, tok);
+    ty = declarator(&tok, tok, ty, &name);
+    fn->sym = get_ident(name);
+
+    tok = skip(tok, PU_LBRACE);
+    fn->body = compound_stmt(rest, tok);
+    fold_function(fn);
+}
+
+// Returns the first token of each top-level function definition and
+// stores their number to *n. A definition ends with the "}" that closes
+// its first "{", so the boundaries are found by brace matching without
+// parsing. Malformed input still yields ranges; the parser then reports
+// the error in the range where the serial parse would report it.
+static Token **split_functions(Token *tok, int *n) {
+    int cap = 16;
+    Token **starts = malloc(sizeof(Token *) * cap);
+    *n = 0;
+
+    int depth = 0;
+    bool in_function = false;
+
+    for (; tok->kind != TK_EOF; tok++) {
+        if (!in_function) {
+            if (*n == cap) {
+                cap *= 2;
+                starts = realloc(starts, sizeof(Token *) * cap);
+            }
+            starts[(*n)++] = tok;
+            in_function = true;
+        }
 
-    locals = NULL;
+        if (tok->punct == PU_LBRACE) {
+            depth++;
+        } else if (tok->punct == PU_RBRACE && depth > 0) {
+            if (--depth == 0)
+                in_function = false;
+        }
+    }
 
-    Function *fn = calloc(1, sizeof(Function));
-    fn->name = get_ident(ty->name);
+    return starts;
+}
 
-    tok = skip(tok, "{");
+typedef struct {
+    Token **starts;
+    Function **fns;
+} ParseJobs;
 
-    fn->body = compound_stmt(rest, tok, cons);
-    fn->locals = locals;
-    return fn;
+static void parse_job(void *arg, int i) {
+    ParseJobs *jobs = arg;
+    Token *tok;
+    function(&tok, jobs->starts[i], jobs->fns[i]);
+}
+
+// Parses function definitions on `nthreads` threads. The result is the
+// same as parsing them one after another, including which error is
+// reported: the one in the first function that fails.
+static void parse_parallel(Token *tok, int nthreads) {
+    int n;
+    Token **starts = split_functions(tok, &n);
+
+    ParseJobs jobs = {
+        .starts = starts,
+        .fns = malloc(sizeof(Function *) * n),
+    };
+
+    // Functions are allocated up front, since the compile arena isn't
+    // shared between threads.
+    Function **link = &current_ctx->prog;
+    for (int i = 0; i < n; i++) {
+        Function *fn = arena_alloc(&current_ctx->arena, sizeof(Function));
+        *link = jobs.fns[i] = fn;
+        link = &fn->next;
+    }
+
+    char *errmsg = parallel_for(nthreads, n, parse_job, &jobs);
+
+    free(starts);
+    free(jobs.fns);
+
+    if (errmsg)
+        error_rethrow(errmsg);
 }
 
 // program = function-definition*
-Function *parse(Token *tok, Const *cons) {
-    Function head = {};
-    Function *cur = &head;
+//
+// Functions are linked into the context before they are parsed, so that
+// the context can release their arenas if parsing fails.
+Function *parse(Token *tok) {
+    if (current_ctx->nthreads > 1) {
+        parse_parallel(tok, current_ctx->nthreads);
+        return current_ctx->prog;
+    }
 
-    while (tok->kind != TK_EOF)
-        cur = cur->next = function(&tok, tok, cons);
+    Function **link = &current_ctx->prog;
 
-    return head.next;
-}
\ No newline at end of file
+    while (tok->kind != TK_EOF) {
+        Function *fn = arena_alloc(&current_ctx->arena, sizeof(Function));
+        *link = fn;
+        link = &fn->next;
+        function(&tok, tok, fn);
+    }
+
+    return current_ctx->prog;
+}
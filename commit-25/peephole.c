@@ -0,0 +1,291 @@
+// This file contains the peephole optimizer.
+//
+// peephole() rewrites the instructions of a function by matching short
+// patterns. Each rule in the table below looks at the instruction at one
+// position and the few after it, and rewrites them in place if they
+// match. The rules are applied over the list until none of them
+// matches anywhere. Every rewrite removes an instruction or replaces one
+// with a cheaper one, so this terminates.
+//
+// To add a rule, write a function that matches and rewrites at a
+// position, and add it to the table with a name for -stats.
+
+#include "chibicc.h"
+
+// The function being optimized. Functions are optimized by the thread
+// that generates them.
+static _Thread_local Function *current_fn;
+
+// Set when a rewrite may let a rule match at an instruction that the
+// current pass has already gone past, so that another pass is needed.
+static _Thread_local bool revisit;
+
+static bool is_jump(Inst *inst) {
+    return inst->op == OP_JMP || inst->op == OP_JZ || inst->op == OP_JN;
+}
+
+// POP R0 discards the value on top of the stack. R0 is only read right
+// after a call, to restore the value that the call set aside in it.
+static bool is_discard(Inst *inst) {
+    return inst && inst->op == OP_POP_REG && inst->reg == 0;
+}
+
+// Returns the first instruction after the definition of a label that
+// is not a label, or NULL if there is none.
+static Inst *label_target(Label *label) {
+    Inst *inst = label->def ? label->def->next : NULL;
+    while (inst && inst->op == OP_LABEL)
+        inst = inst->next;
+    return inst;
+}
+
+// Drops a jump to a label. A label that nothing jumps to any more may
+// be anywhere in the function.
+static void unref(Label *label) {
+    if (--label->refs == 0)
+        revisit = true;
+}
+
+// Removes the instruction *link from the list
+static void delete(Inst **link) {
+    Inst *inst = *link;
+    if (is_jump(inst))
+        unref(inst->label);
+    *link = inst->next;
+}
+
+// Code after JMP or RET that no label leads to never runs.
+static bool dead_code(Inst **link) {
+    Inst *inst = *link;
+    if (inst->op != OP_JMP && inst->op != OP_RET)
+        return false;
+    if (!inst->next || inst->next->op == OP_LABEL)
+        return false;
+
+    delete(&inst->next);
+    return true;
+}
+
+// A jump to a label right after it does nothing, since JZ and JN don't
+// pop the value they test.
+static bool jump_to_next(Inst **link) {
+    Inst *inst = *link;
+    if (!is_jump(inst))
+        return false;
+
+    for (Inst *p = inst->next; p && p->op == OP_LABEL; p = p->next) {
+        if (p->label == inst->label) {
+            // The label is just ahead, so the pass gets to it anyway.
+            inst->label->refs--;
+            *link = inst->next;
+            return true;
+        }
+    }
+    return false;
+}
+
+// A jump to a JMP goes where the JMP goes. Chains are followed to their
+// end. A cycle of JMPs has no end and is left alone.
+static bool jump_to_jump(Inst **link) {
+    Inst *inst = *link;
+    if (!is_jump(inst))
+        return false;
+
+    Label *dest = inst->label;
+    for (int hops = 0;; hops++) {
+        Inst *target = label_target(dest);
+        if (!target || target->op != OP_JMP)
+            break;
+        if (hops == 8)
+            return false;
+        dest = target->label;
+    }
+
+    if (dest == inst->label)
+        return false;
+
+    unref(inst->label);
+    inst->label = dest;
+    dest->refs++;
+    return true;
+}
+
+// A JMP to RET returns right away.
+static bool jump_to_ret(Inst **link) {
+    Inst *inst = *link;
+    if (inst->op != OP_JMP)
+        return false;
+
+    Inst *target = label_target(inst->label);
+    if (!target || target->op != OP_RET)
+        return false;
+
+    unref(inst->label);
+    inst->op = OP_RET;
+    return true;
+}
+
+// A label that nothing jumps to. The entry point of the function is
+// kept, since it is called from other functions.
+static bool unused_label(Inst **link) {
+    Inst *inst = *link;
+    if (inst->op != OP_LABEL || inst->label->refs > 0 || link == &current_fn->code)
+        return false;
+
+    delete(link);
+    return true;
+}
+
+// A value that is loaded and then discarded need not be loaded.
+static bool discard_load(Inst **link) {
+    Inst *inst = *link;
+    if (!is_discard(inst->next))
+        return false;
+
+    switch (inst->op) {
+        case OP_LOAD:
+        case OP_LOAD_VAR:
+        case OP_LOAD_ADDR:
+        case OP_LOAD_REG:
+            *link = inst->next->next;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Discarding the result of an operation discards its operands instead.
+// DIV is kept, since it faults on division by zero.
+static bool discard_op(Inst **link) {
+    Inst *inst = *link;
+    if (!is_discard(inst->next))
+        return false;
+
+    switch (inst->op) {
+        case OP_NEG:
+        case OP_DEREF:
+            *link = inst->next;
+            return true;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_EQU:
+            inst->op = OP_POP_REG;
+            inst->reg = 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Storing a register's own value back to it does nothing.
+static bool self_store(Inst **link) {
+    Inst *inst = *link;
+    Inst *next = inst->next;
+    if (inst->op != OP_LOAD_REG || next->op != OP_POP_REG || inst->reg != next->reg)
+        return false;
+
+    *link = next->next;
+    return true;
+}
+
+#define OP(a) (1u << (a))
+#define ANY (~0u)
+
+// A rule is only tried where the instruction has one of the opcodes in
+// `ops` and the instruction after it one of those in `next`. Checking
+// these first saves calling most rules at most instructions. Every
+// function ends with RET, so there always is a next instruction where
+// a rule could match.
+static struct {
+    char *name;
+    bool (*apply)(Inst **link);
+    uint32_t ops;
+    uint32_t next;
+} rules[] = {
+    {"dead-code", dead_code, OP(OP_JMP) | OP(OP_RET), ANY & ~OP(OP_LABEL)},
+    {"jump-to-next", jump_to_next, OP(OP_JMP) | OP(OP_JZ) | OP(OP_JN), OP(OP_LABEL)},
+    {"jump-to-jump", jump_to_jump, OP(OP_JMP) | OP(OP_JZ) | OP(OP_JN), ANY},
+    {"jump-to-ret", jump_to_ret, OP(OP_JMP), ANY},
+    {"unused-label", unused_label, OP(OP_LABEL), ANY},
+    {"discard-load", discard_load, OP(OP_LOAD) | OP(OP_LOAD_VAR) | OP(OP_LOAD_ADDR) | OP(OP_LOAD_REG),
+     OP(OP_POP_REG)},
+    {"discard-op", discard_op, OP(OP_NEG) | OP(OP_DEREF) | OP(OP_ADD) | OP(OP_SUB) | OP(OP_MUL) | OP(OP_EQU),
+     OP(OP_POP_REG)},
+    {"self-store", self_store, OP(OP_LOAD_REG), OP(OP_POP_REG)},
+};
+
+#undef OP
+#undef ANY
+
+_Static_assert(sizeof(rules) / sizeof(*rules) == PEEPHOLE_RULES,
+               "PEEPHOLE_RULES must match the rule table");
+
+#define NOPCODES (OP_HALT + 1)
+
+// The rules to try for each opcode in table order, terminated by -1.
+// Most instructions have one rule or none, so this saves trying the
+// whole table at every instruction.
+static int op_rules[NOPCODES][PEEPHOLE_RULES + 1];
+static pthread_once_t op_rules_once = PTHREAD_ONCE_INIT;
+
+static void init_op_rules(void) {
+    for (int op = 0; op < NOPCODES; op++) {
+        int n = 0;
+        for (int i = 0; i < PEEPHOLE_RULES; i++)
+            if (rules[i].ops & 1u << op)
+                op_rules[op][n++] = i;
+        op_rules[op][n] = -1;
+    }
+}
+
+void peephole(Function *fn) {
+    pthread_once(&op_rules_once, init_op_rules);
+    current_fn = fn;
+
+    do {
+        revisit = false;
+        Inst **prev = NULL;
+
+        for (Inst **link = &fn->code; *link;) {
+            Inst *inst = *link;
+            if (!inst->next) {
+                link = &inst->next;
+                continue;
+            }
+
+            uint32_t next = 1u << inst->next->op;
+            int *r = op_rules[inst->op];
+            while (*r >= 0 && !((rules[*r].next & next) && rules[*r].apply(link)))
+                r++;
+
+            if (*r < 0) {
+                prev = link;
+                link = &inst->next;
+                continue;
+            }
+
+            fn->peephole_hits[*r]++;
+
+            // The rules are tried again here, and at the instruction
+            // before, where a pattern may now match. Going back further
+            // takes another pass, and so does changing the code that a
+            // label leads to, since jumps to it may have been passed.
+            if (prev && (*prev)->op != OP_LABEL) {
+                link = prev;
+                prev = NULL;
+            } else if (link != &fn->code) {
+                revisit = true;
+            }
+        }
+    } while (revisit);
+}
+
+void print_peephole_stats(FILE *out, Function *prog) {
+    for (int i = 0; i < PEEPHOLE_RULES; i++) {
+        long hits = 0;
+        for (Function *fn = prog; fn; fn = fn->next)
+            hits += fn->peephole_hits[i];
+        fprintf(out, "peephole %s: %ld hits\n", rules[i].name, hits);
+    }
+}
@@ -0,0 +1,96 @@
+// This file contains a minimal thread pool.
+//
+// parallel_for() runs a batch of independent jobs on a few threads and
+// waits for all of them. Threads take the next job in order as they
+// become free, so a long job doesn't hold up the ones behind it.
+
+#include "chibicc.h"
+
+typedef struct {
+    void (*fn)(void *arg, int i);
+    void *arg;
+    int njobs;
+    atomic_int next;    // Next job to hand out
+    Compiler *ctx;
+
+    // The first failed job and its diagnostic
+    pthread_mutex_t lock;
+    int failed;
+    char *errmsg;
+} Pool;
+
+static void run_job(Pool *pool, int i) {
+    ErrorTrap trap = {};
+    error_trap = &trap;
+
+    if (setjmp(trap.jmp) == 0) {
+        pool->fn(pool->arg, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (i < pool->failed) {
+        free(pool->errmsg);
+        pool->failed = i;
+        pool->errmsg = trap.msg;
+    } else {
+        free(trap.msg);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker(void *p) {
+    Pool *pool = p;
+
+    // Jobs run as part of the caller's compilation.
+    Compiler *saved_ctx = current_ctx;
+    ErrorTrap *saved_trap = error_trap;
+    current_ctx = pool->ctx;
+
+    for (;;) {
+        int i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->njobs)
+            break;
+        run_job(pool, i);
+    }
+
+    current_ctx = saved_ctx;
+    error_trap = saved_trap;
+    return NULL;
+}
+
+// Calls fn(arg, i) for every i in [0, njobs) using up to `nthreads`
+// threads, including the calling one. An error raised by a job ends
+// that job only. Returns the diagnostic of the first job, in job order,
+// that raised an error, or NULL. The caller owns the returned string.
+char *parallel_for(int nthreads, int njobs, void (*fn)(void *arg, int i), void *arg) {
+    Pool pool = {
+        .fn = fn,
+        .arg = arg,
+        .njobs = njobs,
+        .ctx = current_ctx,
+        .failed = njobs,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+
+    if (nthreads > njobs)
+        nthreads = njobs;
+
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    int nstarted = 0;
+    for (int i = 1; i < nthreads; i++) {
+        // If a thread can't be started, the others do its share.
+        if (pthread_create(&threads[nstarted], NULL, worker, &pool))
+            break;
+        nstarted++;
+    }
+
+    worker(&pool);
+
+    for (int i = 0; i < nstarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    pthread_mutex_destroy(&pool.lock);
+    return pool.errmsg;
+}
@@ -0,0 +1,226 @@
+// This file decides where local variables live.
+//
+// alloc_locals() runs before a function is generated and decides which
+// of its locals live in registers R1 to R5 and which in the function's
+// frame. R0 is left as scratch and R6 is the frame pointer.
+//
+// Locals whose live ranges don't overlap share a register or a slot. A
+// live range runs from the first use of a local to the last in the order
+// of the code. A loop runs its body again, and a value set late in the
+// body may be used early in the next iteration, so the range of a local
+// first used in a loop starts where the outermost loop starts. Then the
+// ranges of all locals used in a loop overlap. Each local is weighted by
+// its uses, and uses in loops count for more, so loop counters come
+// first. The locals with the largest weights get the registers.
+//
+// A pointer to a local can reach the locals declared next to it, as in
+// *(&x+1), so every local of a function that takes an address gets a
+// slot of its own.
+//
+// Registers are shared by all functions, so codegen saves the
+// registers of a function on the stack around each call it makes.
+
+#include "chibicc.h"
+
+// Registers available for locals, R1 to R<NUM_REGS>
+#define NUM_REGS (REG_FP - 1)
+
+// A use in a loop counts as 8 uses outside of it, and nesting
+// multiplies this up to MAX_DEPTH levels deep.
+#define MAX_DEPTH 5
+
+// Set if the function being allocated takes the address of a local
+static _Thread_local bool addr_taken;
+
+// Uses are numbered from 1 in the order of the code. loop_start is the
+// number of the first use in the outermost loop being walked.
+static _Thread_local int pos;
+static _Thread_local int loop_start;
+
+// Used locals in the order of their first use, which is also the order
+// of the start of their live ranges
+static _Thread_local Obj **live;
+static _Thread_local int nlive;
+
+static void count_uses(Node *node, int depth);
+
+static void count_list(Node *node, int depth) {
+    for (; node; node = node->next)
+        count_uses(node, depth);
+}
+
+static void count_uses(Node *node, int depth) {
+    switch (node->kind) {
+        case ND_NUM:
+            return;
+        case ND_VAR: {
+            Obj *var = node->var;
+            var->uses += 1L << 3 * (depth < MAX_DEPTH ? depth : MAX_DEPTH);
+            var->end = ++pos;
+            if (!var->start) {
+                var->start = depth ? loop_start : pos;
+                live[nlive++] = var;
+            }
+            return;
+        }
+        case ND_ADDR:
+            if (node->lhs->kind == ND_VAR)
+                addr_taken = true;
+            count_uses(node->lhs, depth);
+            return;
+        case ND_NEG:
+        case ND_DEREF:
+        case ND_RETURN:
+        case ND_EXPR_STMT:
+            count_uses(node->lhs, depth);
+            return;
+        case ND_IF:
+            count_uses(node->cond, depth);
+            count_uses(node->then, depth);
+            if (node->els)
+                count_uses(node->els, depth);
+            return;
+        case ND_FOR:
+            if (node->init)
+                count_uses(node->init, depth);
+            if (depth == 0)
+                loop_start = pos + 1;
+            if (node->cond)
+                count_uses(node->cond, depth + 1);
+            if (node->inc)
+                count_uses(node->inc, depth + 1);
+            count_uses(node->then, depth + 1);
+            return;
+        case ND_BLOCK:
+            count_list(node->body, depth);
+            return;
+        case ND_FUNCALL:
+            count_list(node->args, depth);
+            return;
+        default:
+            count_uses(node->lhs, depth);
+            count_uses(node->rhs, depth);
+            return;
+    }
+}
+
+// Returns true if `var` needs a slot in the frame. A local that is never
+// used needs none, unless a pointer to a neighbour may reach it.
+static bool needs_slot(Obj *var) {
+    return !var->reg && (var->uses || addr_taken);
+}
+
+static void count_locals(Function *fn) {
+    for (Obj *var = fn->locals; var; var = var->next) {
+        if (var->reg)
+            fn->reg_locals++;
+        else if (needs_slot(var))
+            fn->mem_locals++;
+    }
+}
+
+// Gives each local in memory a slot of its own in declaration order, as
+// pointer arithmetic between locals expects.
+static void layout_frame(Function *fn) {
+    int size = 0;
+    for (Obj *var = fn->locals; var; var = var->next)
+        if (needs_slot(var))
+            size += 8;
+
+    fn->stack_size = size;
+    for (Obj *var = fn->locals; var; var = var->next)
+        if (needs_slot(var))
+            var->offset = size -= 8;
+}
+
+// Places the used locals of a function that takes no address. First,
+// locals whose live ranges don't overlap are put in the same class.
+// Going by the start of the ranges, each local joins the first class
+// whose last local is no longer live, which makes the fewest classes
+// possible. The classes with the largest weights then get a register
+// each, and the others a slot in the frame. The slot used most goes at
+// offset 0, where it is addressed by R6 alone.
+static void color_locals(Function *fn) {
+    int *class = arena_alloc(&fn->arena, sizeof(int) * nlive);
+    int *class_end = arena_alloc(&fn->arena, sizeof(int) * nlive);
+    long *class_uses = arena_alloc(&fn->arena, sizeof(long) * nlive);
+    int nclasses = 0;
+
+    for (int i = 0; i < nlive; i++) {
+        int c = 0;
+        while (c < nclasses && class_end[c] >= live[i]->start)
+            c++;
+        if (c == nclasses)
+            nclasses++;
+
+        class[i] = c;
+        class_end[c] = live[i]->end;
+        class_uses[c] += live[i]->uses;
+    }
+
+    // The classes with the largest weights, largest first. Ties go to
+    // the class that starts first.
+    int best[NUM_REGS];
+    int n = 0;
+
+    for (int c = 0; c < nclasses; c++) {
+        int i = n < NUM_REGS ? n++ : NUM_REGS;
+        for (; i > 0 && class_uses[best[i - 1]] < class_uses[c]; i--)
+            if (i < NUM_REGS)
+                best[i] = best[i - 1];
+        if (i < NUM_REGS)
+            best[i] = c;
+    }
+
+    int *reg = arena_alloc(&fn->arena, sizeof(int) * nclasses);
+    for (int i = 0; i < n; i++)
+        reg[best[i]] = i + 1;
+
+    int first = -1;
+    for (int c = 0; c < nclasses; c++)
+        if (!reg[c] && (first < 0 || class_uses[first] < class_uses[c]))
+            first = c;
+
+    int *offset = arena_alloc(&fn->arena, sizeof(int) * nclasses);
+    int size = first < 0 ? 0 : 8;
+    for (int c = 0; c < nclasses; c++) {
+        if (!reg[c] && c != first) {
+            offset[c] = size;
+            size += 8;
+        }
+    }
+
+    for (int i = 0; i < nlive; i++) {
+        live[i]->reg = reg[class[i]];
+        live[i]->offset = offset[class[i]];
+    }
+
+    fn->nregs = n;
+    fn->stack_size = size;
+}
+
+// Places the locals of `fn` for generating `body`. The locals may be
+// placed again for another body of the same function.
+void alloc_locals(Function *fn, Node *body) {
+    int nlocals = 0;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        var->uses = 0;
+        var->reg = var->offset = 0;
+        var->start = var->end = 0;
+        nlocals++;
+    }
+
+    addr_taken = false;
+    pos = 0;
+    live = arena_alloc(&fn->arena, sizeof(Obj *) * nlocals);
+    nlive = 0;
+    count_uses(body, 0);
+
+    fn->nregs = 0;
+    fn->reg_locals = fn->mem_locals = 0;
+    if (addr_taken)
+        layout_frame(fn);
+    else
+        color_locals(fn);
+    count_locals(fn);
+}
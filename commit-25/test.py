@@ -15,7 +15,7 @@ def inject_code(filename, code, after):
 
 
 def assert_ret(expected, input):
-    _ = subprocess.getoutput(f"./chibicc '{input}' > tmp.yas")
+    _ = subprocess.getoutput(f"echo '{input}' | ./chibicc -o tmp.yas -")
 
     inject_code(filename="tmp.yas", code="%ret3\nLOAD 3\nRET\n", after="JMP %start")
     inject_code(filename="tmp.yas", code="%ret5\nLOAD 5\nRET\n", after="JMP %start")
@@ -32,6 +32,20 @@ def assert_ret(expected, input):
         print(f"\033[91mError: \033[mExpected {expected}, but got {output}")
 
 
+def assert_parallel(label, input, threads=4):
+    # Output and diagnostics must not depend on the number of threads.
+    def run(j):
+        return subprocess.getstatusoutput(f"echo '{input}' | ./chibicc -j {j} -o /dev/stdout - 2>&1")
+
+    serial = run(1)
+    parallel = run(threads)
+
+    if serial == parallel:
+        print(f"{label} => same with -j {threads}")
+    else:
+        print(f"\033[91mError: \033[m{label}: -j {threads} differs from -j 1")
+
+
 def main():
     assert_ret("0", "int main() { return 0; }")
     assert_ret("42", "int main() { return 42; }")
@@ -62,6 +76,7 @@ def main():
     assert_ret("1", "int main() { return 1>=0; }")
     assert_ret("1", "int main() { return 1>=1; }")
     assert_ret("0", "int main() { return 1>=2; }")
+    assert_ret("4", "int main() { int a=1; int b=2; return (a<b)+(a<=b)+(a!=b)+(b>a)+(a==b); }")
 
     assert_ret("3", "int main() { int a; a=3;  return a; }")
     assert_ret("3", "int main() { int a=3; return a; }")
@@ -94,8 +109,11 @@ def main():
     assert_ret("3", "int main() { int x=3; int y=5; return *(&y-1); }")
     assert_ret("5", "int main() { int x=3; int y=5; return *(&x-(-1)); }")
     assert_ret("5", "int main() { int x=3; int *y=&x; *y=5; return x; }")
+    assert_ret("5", "int main() { int x=3; int *p=&x; int *q=&*p; *q=5; return x; }")
     assert_ret("7", "int main() { int x=3; int y=5; *(&x+1)=7; return y; }")
     assert_ret("7", "int main() { int x=3; int y=5; *(&y-2+1)=7; return x; }")
+    assert_ret("7", "int main() { int x=3; int y=5; *(&x+1-1)=7; return x; }")
+    assert_ret("9", "int main() { int x=3; return x*0 + x*1 + (x+1)+2 - -0; }")
     assert_ret("5", "int main() { int x=3; return (&x+2)-&x+3; }")
 
     assert_ret("3", "int main() { return ret3(); }")
@@ -105,6 +123,17 @@ def main():
     assert_ret("21", "int main() { return add6(1, 2, 3, 4, 5, 6); }")
     assert_ret("66", "int main() { return add6(1,2,add6(3,4,5,6,7,8),9,10,11); }")
     assert_ret("136", "int main() { return add6(1,2,add6(3,add6(4,5,6,7,8,9),10,11,12,13),14,15,16); }")
+    assert_ret("13", "int f() { int i=0; while (i<3) { if (i==1) i=i+1; else i=i+1; } return i; } int main() { int x=10; return x+f(); }")
+    assert_ret("36", "int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; return a+b+c+d+e+f+g+h; }")
+    assert_ret("9", "int f() { int a=1; int b=2; return a+b; } int main() { int i; int s=0; for (i=0; i<3; i=i+1) s=s+f(); return s; }")
+    assert_ret("21", "int f() { int x=1; int *p=&x; return *p; } int main() { int x=2; int *p=&x; int y=f(); return x*10+y; }")
+    assert_ret("9", "int main() { int x=3; int s=0; int i; for (i=0; i<3; i=i+1) { s=s+x; int y=s*2; s=y-s; } return s; }")
+    assert_ret("67", "int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; while (a<3) { a=a+1; b=b+1; c=c+1; d=d+1; e=e+1; f=f+1; g=g+1; } { int x=a+b; c=c+x; } { int y=c+d; e=e+y; } return a+b+c+d+e+f+g; }")
+
+    funcs = " ".join(f"int f{i}() {{ int x={i}; int y=x*2; while (y<{i}+9) y=y+1; return x+y; }}" for i in range(64))
+    assert_parallel("64 functions", funcs + " int main() { return f0()+f63(); }")
+    assert_parallel("error in a later function", funcs + " int g() { return z; } int h() { return 1 +; } int main() { return 0; }")
+    assert_parallel("error in the first function", "int main() { return x; } " + funcs)
     
     
 if __name__ == "__main__":
@@ -1,26 +1,90 @@
 #include "chibicc.h"
 
-// Input string
-static char *current_input;
+_Thread_local ErrorTrap *error_trap;
 
-// Reports an error and exits
+// Opens the stream an error message is written to. If an error trap is
+// set, the message is collected for it; otherwise it goes to stderr.
+static FILE *open_error(char **buf, size_t *buflen) {
+    if (error_trap)
+        return open_memstream(buf, buflen);
+    return stderr;
+}
+
+// Finishes an error message. If an error trap is set, the message is
+// stored to it and control returns to where it was set. Otherwise the
+// process exits.
+static _Noreturn void raise_error(FILE *fp, char **buf) {
+    if (fp == stderr)
+        exit(1);
+
+    fclose(fp);
+    error_trap->msg = *buf;
+    longjmp(error_trap->jmp, 1);
+}
+
+// Reports an error
 void error(char *fmt, ...) {
+    char *buf;
+    size_t buflen;
+    FILE *fp = open_error(&buf, &buflen);
+
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    vfprintf(fp, fmt, ap);
+    fprintf(fp, "\n");
+    va_end(ap);
+    raise_error(fp, &buf);
+}
+
+// Raises an error again whose diagnostic was caught by another trap,
+// typically one on another thread. Takes ownership of `msg`.
+void error_rethrow(char *msg) {
+    char *buf;
+    size_t buflen;
+    FILE *fp = open_error(&buf, &buflen);
+    fputs(msg, fp);
+    free(msg);
+    raise_error(fp, &buf);
 }
 
-// Reports an error location and exit.
+// Reports an error message in the following format.
+//
+// foo.c:10: x = y + 1;
+//               ^ <error message here>
 static void verror_at(char *loc, char *fmt, va_list ap) {
-    int pos = loc - current_input;
-    fprintf(stderr, "%s\n", current_input);
-    fprintf(stderr, "%*s", pos, ""); // print pos spaces.
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    char *input = current_ctx->input;
+    char *input_end = input + current_ctx->input_len;
+
+    // Find a line containing `loc`.
+    char *line = loc;
+    while (input < line && line[-1] != '\n')
+        line--;
+
+    char *end = loc;
+    while (end < input_end && *end != '\n')
+        end++;
+
+    // Get a line number.
+    int line_no = 1;
+    for (char *p = input; p < line; p++)
+        if (*p == '\n')
+            line_no++;
+
+    char *buf;
+    size_t buflen;
+    FILE *fp = open_error(&buf, &buflen);
+
+    // Print out the line.
+    int indent = fprintf(fp, "%s:%d: ", current_ctx->filename, line_no);
+    fprintf(fp, "%.*s\n", (int)(end - line), line);
+
+    // Show the error message.
+    int pos = loc - line + indent;
+    fprintf(fp, "%*s", pos, ""); // print pos spaces.
+    fprintf(fp, "^ ");
+    vfprintf(fp, fmt, ap);
+    fprintf(fp, "\n");
+    raise_error(fp, &buf);
 }
 
 void error_at(char *loc, char *fmt, ...) {
@@ -32,25 +96,102 @@ void error_at(char *loc, char *fmt, ...) {
 void error_tok(Token *tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    verror_at(tok->loc, fmt, ap);
+    verror_at(tok_loc(tok), fmt, ap);
+}
+
+// Returns the location of a token in the input
+char *tok_loc(Token *tok) {
+    return current_ctx->input + tok->pos;
 }
 
 // Consumes the current token if it matches `s`
 bool equal(Token *tok, char *op) {
-    return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
+    return memcmp(tok_loc(tok), op, tok->len) == 0 && op[tok->len] == '\0';
+}
+
+// Returns the canonical, NUL-terminated name of a symbol
+char *sym_name(int sym) {
+    return current_ctx->sym_names[sym];
+}
+
+static uint32_t hash_ident(char *p, int len) {
+    // FNV-1a
+    uint32_t hash = 2166136261;
+    for (int i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)p[i]) * 16777619;
+    return hash;
+}
+
+static void grow_sym_table(Compiler *ctx) {
+    SymEntry *old = ctx->sym_table;
+    int oldcap = ctx->sym_table_cap;
+
+    ctx->sym_table_cap = oldcap ? oldcap * 2 : 1024;
+    ctx->sym_table = malloc(sizeof(SymEntry) * ctx->sym_table_cap);
+    for (int i = 0; i < ctx->sym_table_cap; i++)
+        ctx->sym_table[i].sym = -1;
+
+    for (int i = 0; i < oldcap; i++) {
+        if (old[i].sym == -1)
+            continue;
+
+        int j = old[i].hash & (ctx->sym_table_cap - 1);
+        while (ctx->sym_table[j].sym != -1)
+            j = (j + 1) & (ctx->sym_table_cap - 1);
+        ctx->sym_table[j] = old[i];
+    }
+
+    free(old);
+
+    ctx->sym_names = realloc(ctx->sym_names, sizeof(char *) * ctx->sym_table_cap / 2);
+    ctx->sym_lens = realloc(ctx->sym_lens, sizeof(int) * ctx->sym_table_cap / 2);
+}
+
+// Returns the symbol id of the identifier [p, p+len), creating one the
+// first time a name is seen. Only new names are copied.
+static int intern(Compiler *ctx, char *p, int len) {
+    // Keep the table at most half full.
+    if (ctx->nsyms >= ctx->sym_table_cap / 2)
+        grow_sym_table(ctx);
+
+    uint32_t hash = hash_ident(p, len);
+    int mask = ctx->sym_table_cap - 1;
+    int i = hash & mask;
+
+    for (; ctx->sym_table[i].sym != -1; i = (i + 1) & mask) {
+        SymEntry *e = &ctx->sym_table[i];
+        if (e->hash == hash && ctx->sym_lens[e->sym] == len && !memcmp(ctx->sym_names[e->sym], p, len))
+            return e->sym;
+    }
+
+    int sym = ctx->nsyms++;
+    ctx->sym_table[i].hash = hash;
+    ctx->sym_table[i].sym = sym;
+    ctx->sym_names[sym] = arena_strndup(&ctx->arena, p, len);
+    ctx->sym_lens[sym] = len;
+    return sym;
 }
 
-// Ensure that the current token is `s`
-Token *skip(Token *tok, char *s) {
-    if (!equal(tok, s)) 
-        error_tok(tok, "Expected '%s'", s);
+// Spellings of punctuators, for diagnostics
+static char *punct_str[] = {
+    [PU_PLUS] = "+", [PU_MINUS] = "-", [PU_STAR] = "*", [PU_SLASH] = "/",
+    [PU_AMP] = "&", [PU_EQ] = "==", [PU_NE] = "!=", [PU_LT] = "<",
+    [PU_LE] = "<=", [PU_GT] = ">", [PU_GE] = ">=", [PU_ASSIGN] = "=",
+    [PU_LPAREN] = "(", [PU_RPAREN] = ")", [PU_LBRACE] = "{", [PU_RBRACE] = "}",
+    [PU_COMMA] = ",", [PU_SEMICOLON] = ";",
+};
+
+// Ensure that the current token is the punctuator `kind`
+Token *skip(Token *tok, PunctKind kind) {
+    if (tok->punct != kind)
+        error_tok(tok, "Expected '%s'", punct_str[kind]);
 
-    return tok->next;
+    return tok + 1;
 }
 
-bool consume(Token **rest, Token *tok, char *str) {
-    if (equal(tok, str)) {
-        *rest = tok->next;
+bool consume(Token **rest, Token *tok, PunctKind kind) {
+    if (tok->punct == kind) {
+        *rest = tok + 1;
         return true;
     }
 
@@ -58,100 +199,256 @@ bool consume(Token **rest, Token *tok, char *str) {
     return false;
 }
 
-// Create a new token
-static Token *new_token(TokenKind kind, char *start, char *end) {
-    Token *tok = calloc(1, sizeof(Token));
+// Create a new token at the end of the token buffer. The returned
+// pointer is only valid until the next call.
+static Token *new_token(Compiler *ctx, TokenKind kind, char *start, char *end) {
+    if (ctx->tokens_len == ctx->tokens_cap) {
+        ctx->tokens_cap *= 2;
+        ctx->tokens = realloc(ctx->tokens, sizeof(Token) * ctx->tokens_cap);
+    }
+
+    Token *tok = &ctx->tokens[ctx->tokens_len++];
     tok->kind = kind;
-    tok->loc = start;
     tok->len = end - start;
+    tok->pos = start - ctx->input;
+    tok->punct = PU_NONE;
+    tok->keyword = KW_NONE;
+    tok->val = 0;
     return tok;
 }
 
-static bool startswith(char *p, char *q) {
-    return strncmp(p, q, strlen(q)) == 0;
-}
+// Character classes
+enum {
+    CH_SPACE = 1,
+    CH_DIGIT = 2,
+    CH_ALPHA = 4, // Letters and '_'
+    CH_PUNCT = 8,
+};
 
-// Returns true if c is valid as the first character of an identifier.
-static bool is_ident1(char c) {
-    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
-}
+// Maps each byte to its character class. Unlike <ctype.h>, the table
+// doesn't depend on the current locale.
+static const unsigned char char_class[256] = {
+    ['\t'] = CH_SPACE, ['\n'] = CH_SPACE, ['\v'] = CH_SPACE, ['\f'] = CH_SPACE,
+    ['\r'] = CH_SPACE, [' '] = CH_SPACE,
 
-// Returns true if c is valid as a non-first character of an identifier.
-static bool is_ident2(char c) {
-    return is_ident1(c) || ('0' <= c && c <= '9');
-}
+    ['0'] = CH_DIGIT, ['1'] = CH_DIGIT, ['2'] = CH_DIGIT, ['3'] = CH_DIGIT,
+    ['4'] = CH_DIGIT, ['5'] = CH_DIGIT, ['6'] = CH_DIGIT, ['7'] = CH_DIGIT,
+    ['8'] = CH_DIGIT, ['9'] = CH_DIGIT,
+
+    ['A'] = CH_ALPHA, ['B'] = CH_ALPHA, ['C'] = CH_ALPHA, ['D'] = CH_ALPHA, ['E'] = CH_ALPHA, ['F'] = CH_ALPHA,
+    ['G'] = CH_ALPHA, ['H'] = CH_ALPHA, ['I'] = CH_ALPHA, ['J'] = CH_ALPHA, ['K'] = CH_ALPHA, ['L'] = CH_ALPHA,
+    ['M'] = CH_ALPHA, ['N'] = CH_ALPHA, ['O'] = CH_ALPHA, ['P'] = CH_ALPHA, ['Q'] = CH_ALPHA, ['R'] = CH_ALPHA,
+    ['S'] = CH_ALPHA, ['T'] = CH_ALPHA, ['U'] = CH_ALPHA, ['V'] = CH_ALPHA, ['W'] = CH_ALPHA, ['X'] = CH_ALPHA,
+    ['Y'] = CH_ALPHA, ['Z'] = CH_ALPHA,
+    ['a'] = CH_ALPHA, ['b'] = CH_ALPHA, ['c'] = CH_ALPHA, ['d'] = CH_ALPHA, ['e'] = CH_ALPHA, ['f'] = CH_ALPHA,
+    ['g'] = CH_ALPHA, ['h'] = CH_ALPHA, ['i'] = CH_ALPHA, ['j'] = CH_ALPHA, ['k'] = CH_ALPHA, ['l'] = CH_ALPHA,
+    ['m'] = CH_ALPHA, ['n'] = CH_ALPHA, ['o'] = CH_ALPHA, ['p'] = CH_ALPHA, ['q'] = CH_ALPHA, ['r'] = CH_ALPHA,
+    ['s'] = CH_ALPHA, ['t'] = CH_ALPHA, ['u'] = CH_ALPHA, ['v'] = CH_ALPHA, ['w'] = CH_ALPHA, ['x'] = CH_ALPHA,
+    ['y'] = CH_ALPHA, ['z'] = CH_ALPHA,
+    ['_'] = CH_ALPHA,
+
+    ['!'] = CH_PUNCT, ['"'] = CH_PUNCT, ['#'] = CH_PUNCT, ['$'] = CH_PUNCT, ['%'] = CH_PUNCT, ['&'] = CH_PUNCT,
+    ['\''] = CH_PUNCT, ['('] = CH_PUNCT, [')'] = CH_PUNCT, ['*'] = CH_PUNCT, ['+'] = CH_PUNCT, [','] = CH_PUNCT,
+    ['-'] = CH_PUNCT, ['.'] = CH_PUNCT, ['/'] = CH_PUNCT, [':'] = CH_PUNCT, [';'] = CH_PUNCT, ['<'] = CH_PUNCT,
+    ['='] = CH_PUNCT, ['>'] = CH_PUNCT, ['?'] = CH_PUNCT, ['@'] = CH_PUNCT, ['['] = CH_PUNCT, ['\\'] = CH_PUNCT,
+    [']'] = CH_PUNCT, ['^'] = CH_PUNCT, ['`'] = CH_PUNCT, ['{'] = CH_PUNCT, ['|'] = CH_PUNCT, ['}'] = CH_PUNCT,
+    ['~'] = CH_PUNCT,
+};
+
+#ifdef __SSE2__
+// Returns a 16-bit mask of the bytes in c that belong to `cls`.
+static int class_mask16(__m128i c, int cls) {
+    __m128i m = _mm_setzero_si128();
+
+    if (cls & CH_SPACE) {
+        // ' ' or one of '\t', '\n', '\v', '\f' and '\r', which are 9 to 13.
+        __m128i ctl = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(8)),
+                                    _mm_cmplt_epi8(c, _mm_set1_epi8(14)));
+        m = _mm_or_si128(m, _mm_or_si128(ctl, _mm_cmpeq_epi8(c, _mm_set1_epi8(' '))));
+    }
+
+    if (cls & CH_DIGIT) {
+        m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1))));
+    }
 
-// Read a punctuator token from p and return its length
-static int read_punct(char *p) {
-    if (startswith(p, "==") || startswith(p, "!=") || startswith(p, "<=") || startswith(p, ">="))
-        return 2;
+    if (cls & CH_ALPHA) {
+        // Setting bit 5 folds upper case onto lower case. Bytes >= 0x80
+        // are negative as signed chars and never match.
+        __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        m = _mm_or_si128(m, _mm_or_si128(alpha, _mm_cmpeq_epi8(c, _mm_set1_epi8('_'))));
+    }
 
-    return ispunct(*p) ? 1 : 0;
+    return _mm_movemask_epi8(m);
 }
+#endif
 
-static bool is_keyword(Token *tok) {
-    static char *kw[] = {"return", "if", "else", "for", "while", "int"};
+// Returns a pointer to the first character at or after p that doesn't
+// belong to `cls`. Most runs are short, so the first few characters are
+// checked through the table. Longer runs are classified 16 bytes at a
+// time with SSE2 while that many bytes remain before `end`.
+static char *skip_class(char *p, char *end, int cls) {
+    for (int i = 0; i < 8; i++, p++)
+        if (p == end || !(char_class[(unsigned char)*p] & cls))
+            return p;
 
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
-        if (equal(tok, kw[i]))
-            return true;
+#ifdef __SSE2__
+    while (end - p >= 16) {
+        int mask = ~class_mask16(_mm_loadu_si128((__m128i *)p), cls) & 0xffff;
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
     }
+#endif
 
-    return false;
+    while (p < end && (char_class[(unsigned char)*p] & cls))
+        p++;
+    return p;
 }
 
-static void convert_keywords(Token *tok) {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
-        if (is_keyword(t))
-            t->kind = TK_KEYWORD;
+// Read a punctuator token from p. Returns its length and stores its kind
+// to *kind, or returns 0 if p doesn't start with a punctuator. Two-
+// character punctuators are recognized by looking at the second
+// character only after switching on the first one.
+static int read_punct(char *p, char *end, PunctKind *kind) {
+    bool eq = p + 1 < end && p[1] == '=';
+
+    switch (*p) {
+        case '=':
+            if (eq) {
+                *kind = PU_EQ;
+                return 2;
+            }
+            *kind = PU_ASSIGN;
+            return 1;
+        case '!':
+            if (eq) {
+                *kind = PU_NE;
+                return 2;
+            }
+            *kind = PU_OTHER;
+            return 1;
+        case '<':
+            if (eq) {
+                *kind = PU_LE;
+                return 2;
+            }
+            *kind = PU_LT;
+            return 1;
+        case '>':
+            if (eq) {
+                *kind = PU_GE;
+                return 2;
+            }
+            *kind = PU_GT;
+            return 1;
+        case '+': *kind = PU_PLUS; return 1;
+        case '-': *kind = PU_MINUS; return 1;
+        case '*': *kind = PU_STAR; return 1;
+        case '/': *kind = PU_SLASH; return 1;
+        case '&': *kind = PU_AMP; return 1;
+        case '(': *kind = PU_LPAREN; return 1;
+        case ')': *kind = PU_RPAREN; return 1;
+        case '{': *kind = PU_LBRACE; return 1;
+        case '}': *kind = PU_RBRACE; return 1;
+        case ',': *kind = PU_COMMA; return 1;
+        case ';': *kind = PU_SEMICOLON; return 1;
+        default:
+            *kind = PU_OTHER;
+            return (char_class[(unsigned char)*p] & CH_PUNCT) ? 1 : 0;
     }
 }
 
-// Tokenize a given string and returns new tokens.
-Token *tokenize(char *p) {
-    current_input = p;
-    Token head = {};
-    Token *cur = &head;
+// Returns the keyword kind of the identifier [p, p+len), or KW_NONE.
+// Keywords are told apart by their first character and length, so an
+// identifier is compared against at most two fixed-size candidates,
+// which the compiler turns into plain integer compares.
+static KeywordKind keyword_kind(char *p, int len) {
+#define KW(s) (len == sizeof(s) - 1 && !memcmp(p, s, sizeof(s) - 1))
+    switch (*p) {
+        case 'e':
+            return KW("else") ? KW_ELSE : KW_NONE;
+        case 'f':
+            return KW("for") ? KW_FOR : KW_NONE;
+        case 'i':
+            return KW("if") ? KW_IF : KW("int") ? KW_INT : KW_NONE;
+        case 'r':
+            return KW("return") ? KW_RETURN : KW_NONE;
+        case 'w':
+            return KW("while") ? KW_WHILE : KW_NONE;
+        default:
+            return KW_NONE;
+    }
+#undef KW
+}
+
+// Tokenize the `len` bytes at p, which don't need to be NUL-terminated,
+// and returns new tokens. p must be the input of the current context,
+// which is where token positions point into.
+Token *tokenize(char *p, size_t len) {
+    Compiler *ctx = current_ctx;
+    if (len > UINT32_MAX)
+        error("%s: input too large", ctx->filename);
+
+    // Source code rarely has more tokens than half its length in bytes,
+    // so the buffer rarely grows. It is kept for the next compilation.
+    size_t cap = len / 2 + 16;
+    if (ctx->tokens_cap < cap) {
+        free(ctx->tokens);
+        ctx->tokens_cap = cap;
+        ctx->tokens = malloc(sizeof(Token) * cap);
+    }
+    ctx->tokens_len = 0;
+
+    char *end = p + len;
+
+    while (p < end) {
+        unsigned char cls = char_class[(unsigned char)*p];
 
-    while (*p) {
         // Skip whitespace characters
-        if (isspace(*p)) {
-            p++;
+        if (cls & CH_SPACE) {
+            p = skip_class(p + 1, end, CH_SPACE);
             continue;
         }
 
         // Numeric literal
-        if (isdigit(*p)) {
-            cur = cur->next = new_token(TK_NUM, p, p);
-            char *q = p;
-            cur->val = strtoul(p, &p, 10);
-            cur->len = p - q;
+        if (cls & CH_DIGIT) {
+            char *q = skip_class(p + 1, end, CH_DIGIT);
+            Token *tok = new_token(ctx, TK_NUM, p, q);
+            unsigned long val = 0;
+            for (; p < q; p++)
+                val = val * 10 + (*p - '0');
+            tok->val = val;
             continue;
         }
 
         // Identififer or keyword
-        if (is_ident1(*p)) {
+        if (cls & CH_ALPHA) {
             char *start = p;
-            do {
-                p++;
-            } while (is_ident2(*p));
-            
-            cur = cur->next = new_token(TK_IDENT, start, p);
+            p = skip_class(p + 1, end, CH_ALPHA | CH_DIGIT);
+
+            KeywordKind kw = keyword_kind(start, p - start);
+            if (kw)
+                new_token(ctx, TK_KEYWORD, start, p)->keyword = kw;
+            else
+                new_token(ctx, TK_IDENT, start, p)->sym = intern(ctx, start, p - start);
             continue;
         }
 
         // Puncuators
-        int punct_len = read_punct(p);
+        PunctKind punct;
+        int punct_len = read_punct(p, end, &punct);
         if (punct_len) {
-            cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
-            p += cur->len;
+            new_token(ctx, TK_PUNCT, p, p + punct_len)->punct = punct;
+            p += punct_len;
             continue;
         }
 
         error_at(p, "Invalid token");
     }
 
-    cur = cur->next = new_token(TK_EOF, p, p);
-    convert_keywords(head.next);
-    return head.next;
-}
\ No newline at end of file
+    new_token(ctx, TK_EOF, p, p);
+    return ctx->tokens;
+}
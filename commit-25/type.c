@@ -6,36 +6,76 @@ bool is_integer(Type *ty) {
     return ty->kind == TY_INT;
 }
 
-Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_PTR;
-    ty->base = base;
-    return ty;
+static Type *derived_from(Type *ty) {
+    return ty->kind == TY_PTR ? ty->base : ty->return_ty;
 }
 
-Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_FUNC;
-    ty->return_ty = return_ty;
-    return ty;
+static uint32_t hash_type(TypeKind kind, Type *from) {
+    return (uint32_t)(((uintptr_t)from >> 3) * 2654435761u) ^ kind;
 }
 
-void add_type(Node *node) {
-    if (!node || node->ty) {
-        return;
+static Type **type_slot(Compiler *ctx, TypeKind kind, Type *from) {
+    int mask = ctx->type_table_cap - 1;
+    for (int i = hash_type(kind, from) & mask;; i = (i + 1) & mask) {
+        Type *ty = ctx->type_table[i];
+        if (!ty || (ty->kind == kind && derived_from(ty) == from))
+            return &ctx->type_table[i];
+    }
+}
+
+static void grow_type_table(Compiler *ctx) {
+    Type **old = ctx->type_table;
+    int oldcap = ctx->type_table_cap;
+
+    ctx->type_table_cap = oldcap ? oldcap * 2 : 64;
+    ctx->type_table = calloc(ctx->type_table_cap, sizeof(Type *));
+
+    for (int i = 0; i < oldcap; i++)
+        if (old[i])
+            *type_slot(ctx, old[i]->kind, derived_from(old[i])) = old[i];
+
+    free(old);
+}
+
+// Returns the canonical type of the given kind derived from `from`,
+// creating it on first use. Functions are parsed concurrently, so the
+// table is locked.
+static Type *derived_type(TypeKind kind, Type *from) {
+    Compiler *ctx = current_ctx;
+    pthread_mutex_lock(&ctx->type_lock);
+
+    if (ctx->type_table_used >= ctx->type_table_cap / 2)
+        grow_type_table(ctx);
+
+    Type **slot = type_slot(ctx, kind, from);
+    if (!*slot) {
+        Type *ty = arena_alloc(&ctx->arena, sizeof(Type));
+        ty->kind = kind;
+        if (kind == TY_PTR)
+            ty->base = from;
+        else
+            ty->return_ty = from;
+
+        ctx->type_table_used++;
+        *slot = ty;
     }
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
+    Type *ty = *slot;
+    pthread_mutex_unlock(&ctx->type_lock);
+    return ty;
+}
+
+Type *pointer_to(Type *base) {
+    return derived_type(TY_PTR, base);
+}
 
-    for (Node *n = node->body; n; n = n->next)
-        add_type(n);
+Type *func_type(Type *return_ty) {
+    return derived_type(TY_FUNC, return_ty);
+}
 
+// Assigns a type to an expression node whose operands already have
+// types. Statements have no type.
+void add_type(Node *node) {
     switch (node->kind) {
         case ND_ADD:
         case ND_SUB: